@@ -0,0 +1,34 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "cpu_usage.h"
+
+void cpu_usage_sample(float busy_percent[configNUMBER_OF_CORES])
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    static configRUN_TIME_COUNTER_TYPE last_idle[configNUMBER_OF_CORES];
+    static int64_t last_us;
+
+    // The run-time stats clock is esp_timer, so idle counters are in microseconds
+    int64_t now_us = esp_timer_get_time();
+    uint32_t elapsed_us = (uint32_t)(now_us - last_us);
+
+    for (int core = 0; core < configNUMBER_OF_CORES; core++)
+    {
+        configRUN_TIME_COUNTER_TYPE idle = ulTaskGetIdleRunTimeCounterForCore(core);
+        uint32_t idle_us = (uint32_t)(idle - last_idle[core]);
+        last_idle[core] = idle;
+
+        busy_percent[core] = elapsed_us > 0 && idle_us < elapsed_us
+                                 ? 100.0f * (elapsed_us - idle_us) / elapsed_us
+                                 : 0.0f;
+    }
+    last_us = now_us;
+#else
+    for (int core = 0; core < configNUMBER_OF_CORES; core++)
+    {
+        busy_percent[core] = 0.0f;
+    }
+#endif
+}
@@ -0,0 +1,13 @@
+#ifndef CPU_USAGE_H
+#define CPU_USAGE_H
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Per-core CPU utilisation since the previous call, derived from the idle
+ * tasks' run-time counters. Needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS;
+ * without it every core reports 0. The first call measures from boot.
+ */
+void cpu_usage_sample(float busy_percent[configNUMBER_OF_CORES]);
+
+#endif
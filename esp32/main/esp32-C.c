@@ -1,4 +1,6 @@
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -11,25 +13,44 @@
 #include "esp_http_client.h"
 #include "esp_system.h"
 #include "esp_ota_ops.h"
-#include "esp_https_ota.h"
-#include "esp_sntp.h"
 #include "esp_sleep.h"
 #include "esp_pm.h"
+#include "esp_attr.h"
 #include "freertos/event_groups.h"
 #include "wifi_config.h"
 #include "cJSON.h"
 #include "driver/rtc_io.h"
+#include "esp_log.h"
+#include "esp_rtc_time.h"
+#include "esp_rom_sys.h"
+#include "esp_mac.h"
 
 #include "bme680/bme68x.h"
+#include "ota_delta.h"
+#include "ota_resume.h"
+#include "ota_verify.h"
+#include "spsc_queue.h"
+#include "cpu_usage.h"
+#include "gas_scan.h"
+#include "iaq.h"
+#include "sample_stats.h"
+#include "journal.h"
+#include "wake_plan.h"
+#include "phase_prof.h"
+#include "time_sync.h"
+#include "net_health.h"
+
+static const char *TAG = "sensor_node";
 
 #define SERVER_URL "https://10.184.34.192:5000/sensor"
-#define VERSION_URL "https://10.184.34.192:5000/firmware/version"
+#define SERVER_BATCH_URL "https://10.184.34.192:5000/sensor/batch"
 #define OTA_URL "https://10.184.34.192:5000/firmware/latest"
 #define FIRMWARE_VERSION "1.2.0"
+#define DELTA_OTA_URL "https://10.184.34.192:5000/firmware/delta?from=" FIRMWARE_VERSION
 
-#define DEEP_SLEEP_DURATION_SEC 300 // 5 minutes
-#define OTA_CHECK_INTERVAL 24       // Check for OTA updates every 24 wake cycles (2 hours)
+#define DEEP_SLEEP_DURATION_SEC 300 // 5 minutes, until the server says otherwise
 #define WIFI_TIMEOUT_MS 30000       // 30 seconds wifi connection timeout
+#define OTA_WAKE_BUDGET_MS 15000    // Max time spent downloading firmware per wake
 
 #define I2C_MASTER_SCL_IO 5
 #define I2C_MASTER_SDA_IO 4
@@ -38,18 +59,135 @@
 #define I2C_MASTER_TX_BUF_DISABLE 0
 #define I2C_MASTER_RX_BUF_DISABLE 0
 
+#define SENSOR_TASK_CORE 1 // Wi-Fi and the event loop run on core 0
+#define SENSOR_TASK_STACK_SIZE 4096
+#define SENSOR_TASK_PRIORITY 5
+#define SENSOR_TASK_TIMEOUT_MS 60000 // a 10-step heater scan at the 4032 ms maximum, with its extra polls
+
 #define WIFI_CONNECTED_BIT BIT0
-static EventGroupHandle_t wifi_event_group;
+#define SENSOR_DONE_BIT BIT1
+static EventGroupHandle_t wake_event_group;
+static TickType_t wifi_start_tick;
+
+#if CONFIG_APP_CONTINUOUS_SAMPLING
+#define UPLINK_TASK_CORE 0
+#define UPLINK_TASK_STACK_SIZE 8192
+#define UPLINK_TASK_PRIORITY 4 // below sampling so heater timing always wins
+#define UPLINK_POLL_MS 1000
+#define SAMPLE_QUEUE_LEN 8
+#define CONFIG_QUEUE_LEN 2
+#endif
 
 #define NVS_NAMESPACE "t_mon"
 #define NVS_WAKE_COUNT_KEY "wake_cnt"
 #define NVS_LAST_OTA_KEY "last_ota"
+#define NVS_CONFIG_KEY "cfg"
+
+#define WAKE_COUNTER_MAGIC 0x57414b45     // "WAKE"
+#define OTA_REJECT_MAGIC 0x4f524a31       // "ORJ1"
+#define OTA_REJECT_SKIP_MIN 12            // announcements of a rejected image ignored after its first failure
+#define OTA_REJECT_SKIP_MAX 288           // doubled per repeat up to a day at the default sleep
+#define WAKE_COUNT_CHECKPOINT_INTERVAL 12 // NVS commit once an hour at the default sleep
+
+#define HTTP_RESPONSE_BUF_SIZE 512
+#define JOURNAL_DRAIN_BATCH 64 // records per bulk upload, 2 KB
+
+// Settings the server can push in the control block of the /sensor response
+typedef struct
+{
+    uint32_t sleep_sec;
+    uint16_t heatr_temp;
+    uint16_t heatr_dur;
+    gas_profile_t profile; // multi-step heater scan, replaces the single point when set
+} device_config_t;
+
+typedef struct
+{
+    bool valid;
+    char fw_version[32];
+    uint32_t fw_crc;
+} server_control_t;
+
+typedef struct
+{
+    char buf[HTTP_RESPONSE_BUF_SIZE];
+    int len;
+} http_response_t;
+
+typedef struct
+{
+    float temperature;
+    float humidity;
+    float pressure;
+    int gas_resistance;
+    uint8_t n_gas;
+    uint32_t gas_fp[GAS_SCAN_MAX_STEPS]; // gas resistance per heater profile step
+    iaq_result_t iaq;
+    uint32_t timestamp; // Unix time at acquisition, 0 until the clock has been synced
+    bool valid;
+} sensor_sample_t;
+
+typedef struct
+{
+    sensor_sample_t mean;
+    sample_stats_t stats;
+} sensor_aggregate_t;
+
+// Kept in RTC memory so warm wakes need not read it back from NVS
+static RTC_DATA_ATTR bool device_config_cached;
+static RTC_DATA_ATTR device_config_t device_config = {
+    .sleep_sec = DEEP_SLEEP_DURATION_SEC,
+    .heatr_temp = 320,
+    .heatr_dur = 150,
+};
+
+#if CONFIG_APP_CONTINUOUS_SAMPLING
+static spsc_queue_t sample_queue; // core 1 -> core 0: one aggregate per upload period
+static spsc_queue_t config_queue; // core 0 -> core 1: sampling config pushed by the server
+static sensor_aggregate_t sample_queue_storage[SAMPLE_QUEUE_LEN];
+static device_config_t config_queue_storage[CONFIG_QUEUE_LEN];
+#endif
+
+// Survives deep sleep; NVS only gets a checkpoint every few wakes
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t count_inv; // ~count, catches RTC memory that did not survive intact
+    uint32_t checkpointed;
+} wake_counter_t;
 
+static RTC_DATA_ATTR wake_counter_t wake_counter;
+
+// RTC time at which the current deep sleep ends
+static RTC_DATA_ATTR uint64_t sleep_end_rtc_us;
+
+// Last announced image that downloaded completely but failed verification
+typedef struct
+{
+    uint32_t magic;
+    uint32_t fw_crc;
+    char fw_version[32];
+    uint16_t skip;     // announcements still to ignore
+    uint8_t failures;
+} ota_reject_t;
+
+static RTC_DATA_ATTR ota_reject_t ota_reject;
 static struct bme68x_dev gas_sensor;
 static bool wifi_connected = false;
+// Station MAC as 12 hex digits; identifies this node to the server
+static char device_id[13];
 
 extern const uint8_t cert_pem_start[] asm("_binary_cert_pem_start");
 
+static void init_device_id(void)
+{
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+    snprintf(device_id, sizeof(device_id), "%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
 void wifi_event_handler(void *arg, esp_event_base_t event_base,
                         int32_t event_id, void *event_data)
 {
@@ -57,17 +195,24 @@ void wifi_event_handler(void *arg, esp_event_base_t event_base,
     {
         esp_wifi_connect();
     }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        net_health_wifi_associated();
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
-        printf("Disconnected from WiFi, retrying...\n");
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        ESP_LOGW(TAG, "Disconnected from WiFi (reason %u), retrying...", event->reason);
+        net_health_wifi_disconnected(event->reason);
         esp_wifi_connect();
-        xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        xEventGroupClearBits(wake_event_group, WIFI_CONNECTED_BIT);
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-        printf("Got IP: " IPSTR "\n", IP2STR(&event->ip_info.ip));
-        xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        net_health_wifi_got_ip();
+        xEventGroupSetBits(wake_event_group, WIFI_CONNECTED_BIT);
         wifi_connected = true;
     }
 }
@@ -130,10 +275,12 @@ void user_delay_us(uint32_t period, void *intf_ptr)
     vTaskDelay(pdMS_TO_TICKS(period + 999) / 1000);
 }
 
-bool wifi_init_and_connect(void)
+// Starts association without waiting for it; wifi_wait_connected() joins later
+void wifi_start(void)
 {
-    wifi_event_group = xEventGroupCreate();
     wifi_connected = false;
+    wifi_start_tick = xTaskGetTickCount();
+    net_health_wifi_start();
 
     esp_netif_init();
     esp_event_loop_create_default();
@@ -156,22 +303,29 @@ bool wifi_init_and_connect(void)
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
     esp_wifi_start();
 
-    printf("Connecting to WiFi...\n");
+    ESP_LOGI(TAG, "Connecting to WiFi...");
+}
+
+bool wifi_wait_connected(void)
+{
+    TickType_t elapsed = xTaskGetTickCount() - wifi_start_tick;
+    TickType_t timeout = pdMS_TO_TICKS(WIFI_TIMEOUT_MS);
 
-    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
+    EventBits_t bits = xEventGroupWaitBits(wake_event_group,
                                            WIFI_CONNECTED_BIT,
                                            pdFALSE,
                                            pdFALSE,
-                                           pdMS_TO_TICKS(WIFI_TIMEOUT_MS));
+                                           elapsed < timeout ? timeout - elapsed : 0);
 
     if (bits & WIFI_CONNECTED_BIT)
     {
-        printf("Connected to WiFi\n");
+        ESP_LOGI(TAG, "Connected to WiFi");
         return true;
     }
     else
     {
-        printf("Failed to connect to WiFi within timeout\n");
+        ESP_LOGW(TAG, "Failed to connect to WiFi within timeout");
+        net_health_wifi_failed();
         return false;
     }
 }
@@ -181,13 +335,59 @@ void wifi_cleanup(void)
     esp_wifi_stop();
     esp_wifi_deinit();
     esp_netif_deinit();
-    if (wifi_event_group)
+}
+
+// One pass of the configured heater profile in sequential mode
+bool read_gas_fingerprint(sensor_sample_t *sample, const device_config_t *cfg, struct bme68x_conf *conf)
+{
+    gas_scan_result_t scan;
+    if (!gas_scan_run(&gas_sensor, conf, &cfg->profile, &scan))
     {
-        vEventGroupDelete(wifi_event_group);
+        return false;
+    }
+
+    sample->temperature = scan.temperature;
+    sample->humidity = scan.humidity;
+    sample->pressure = scan.pressure;
+    sample->n_gas = scan.len;
+    memcpy(sample->gas_fp, scan.gas, sizeof(sample->gas_fp));
+
+    // Keep gas_resistance continuous with forced-mode history: report the
+    // step closest to the single-point heater temperature
+    uint8_t best = 0;
+    for (uint8_t i = 1; i < scan.len; i++)
+    {
+        if (abs(cfg->profile.temp[i] - cfg->heatr_temp) < abs(cfg->profile.temp[best] - cfg->heatr_temp))
+        {
+            best = i;
+        }
     }
+    sample->gas_resistance = scan.gas[best];
+    return true;
 }
 
-bool read_sensor_data(float *temp, float *humidity, float *pressure, int *gas_resistance)
+bool sensor_init(void)
+{
+    i2c_master_init();
+
+    static uint8_t dev_addr = BME68X_I2C_ADDR_HIGH;
+    gas_sensor.intf = BME68X_I2C_INTF;
+    gas_sensor.intf_ptr = &dev_addr;
+    gas_sensor.read = bme_i2c_read;
+    gas_sensor.write = bme_i2c_write;
+    gas_sensor.delay_us = user_delay_us;
+    gas_sensor.amb_temp = 25;
+
+    int8_t rslt = bme68x_init(&gas_sensor);
+    if (rslt != BME68X_OK)
+    {
+        ESP_LOGE(TAG, "BME68x initialization failed: %d", rslt);
+        return false;
+    }
+    return true;
+}
+
+bool read_sensor_data(sensor_sample_t *sample, const device_config_t *cfg)
 {
     struct bme68x_conf conf;
     struct bme68x_heatr_conf heatr_conf;
@@ -195,184 +395,540 @@ bool read_sensor_data(float *temp, float *humidity, float *pressure, int *gas_re
     uint8_t n_fields;
     int8_t rslt;
 
+    sample->timestamp = time_sync_unix();
     conf.os_temp = BME68X_OS_8X;
     conf.os_hum = BME68X_OS_2X;
     conf.os_pres = BME68X_OS_4X;
     conf.filter = BME68X_FILTER_OFF;
+    conf.odr = BME68X_ODR_NONE;
     bme68x_set_conf(&conf, &gas_sensor);
 
-    heatr_conf.enable = BME68X_ENABLE_HEATER;
-    heatr_conf.heatr_temp = 320;
-    heatr_conf.heatr_dur = 150;
+    if (cfg->profile.len > 0)
+    {
+        return read_gas_fingerprint(sample, cfg, &conf);
+    }
+
+    heatr_conf.enable = BME68X_ENABLE;
+    heatr_conf.heatr_temp = cfg->heatr_temp;
+    heatr_conf.heatr_dur = cfg->heatr_dur;
     bme68x_set_heatr_conf(BME68X_FORCED_MODE, &heatr_conf, &gas_sensor);
 
     bme68x_set_op_mode(BME68X_FORCED_MODE, &gas_sensor);
-    gas_sensor.delay_us(heatr_conf.heatr_dur * 1000, gas_sensor.intf_ptr);
+    gas_sensor.delay_us(bme68x_get_meas_dur(BME68X_FORCED_MODE, &conf, &gas_sensor) + heatr_conf.heatr_dur * 1000,
+                        gas_sensor.intf_ptr);
 
     rslt = bme68x_get_data(BME68X_FORCED_MODE, &data, &n_fields, &gas_sensor);
     if (rslt == BME68X_OK && n_fields > 0)
     {
-        *temp = data.temperature;
-        *humidity = data.humidity;
-        *pressure = data.pressure;
-        *gas_resistance = data.gas_resistance;
+        sample->temperature = data.temperature;
+        sample->humidity = data.humidity;
+        sample->pressure = data.pressure;
+        sample->gas_resistance = data.gas_resistance;
+        sample->n_gas = 0;
         return true;
     }
 
     return false;
 }
 
-bool send_sensor_data(float temp, float humidity, float pressure, int gas_resistance)
+// Runs on the core Wi-Fi is not using, so the measurement overlaps association
+void sensor_task(void *arg)
+{
+    sensor_sample_t *sample = (sensor_sample_t *)arg;
+
+    sample->valid = sensor_init() && read_sensor_data(sample, &device_config);
+    if (sample->valid)
+    {
+        iaq_update(sample->humidity, sample->gas_resistance, device_config.sleep_sec, &sample->iaq);
+    }
+    xEventGroupSetBits(wake_event_group, SENSOR_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+void load_device_config(void)
 {
-    char post_data[256];
-    snprintf(post_data, sizeof(post_data),
-             "{\"temperature\": %.2f, \"humidity\": %.2f, \"pressure\": %.2f, \"gas_resistance\": %d}",
-             temp, humidity, pressure, gas_resistance);
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
 
+    device_config_t cfg;
+    size_t len = sizeof(cfg);
+    if (nvs_get_blob(nvs_handle, NVS_CONFIG_KEY, &cfg, &len) == ESP_OK && len == sizeof(cfg))
+    {
+        device_config = cfg;
+    }
+    nvs_close(nvs_handle);
+
+    device_config_cached = true;
+    ESP_LOGI(TAG, "Config: sleep %lus, heater %u°C / %ums, profile %u steps",
+             device_config.sleep_sec, device_config.heatr_temp, device_config.heatr_dur,
+             device_config.profile.len);
+}
+
+void save_device_config(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_blob(nvs_handle, NVS_CONFIG_KEY, &device_config, sizeof(device_config));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving config: %s", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+}
+
+esp_err_t http_response_handler(esp_http_client_event_t *evt)
+{
+    http_response_t *resp = (http_response_t *)evt->user_data;
+
+    if (evt->event_id == HTTP_EVENT_ON_CONNECTED)
+    {
+        net_health_http_connected();
+    }
+    else if (evt->event_id == HTTP_EVENT_ON_DATA)
+    {
+        int n = evt->data_len;
+        if (resp->len + n > HTTP_RESPONSE_BUF_SIZE - 1)
+        {
+            n = HTTP_RESPONSE_BUF_SIZE - 1 - resp->len;
+        }
+        memcpy(resp->buf + resp->len, evt->data, n);
+        resp->len += n;
+        resp->buf[resp->len] = '\0';
+    }
+    return ESP_OK;
+}
+
+// "heatr_prof": {"temp": [...], "dur": [...]}; empty lists switch scanning off
+bool parse_heater_profile(const cJSON *obj, gas_profile_t *profile)
+{
+    const cJSON *temps = cJSON_GetObjectItemCaseSensitive(obj, "temp");
+    const cJSON *durs = cJSON_GetObjectItemCaseSensitive(obj, "dur");
+    if (!cJSON_IsArray(temps) || !cJSON_IsArray(durs))
+    {
+        return false;
+    }
+
+    int len = cJSON_GetArraySize(temps);
+    if (len != cJSON_GetArraySize(durs) || len > GAS_SCAN_MAX_STEPS)
+    {
+        return false;
+    }
+
+    gas_profile_t parsed = {.len = len};
+    for (int i = 0; i < len; i++)
+    {
+        const cJSON *t = cJSON_GetArrayItem(temps, i);
+        const cJSON *d = cJSON_GetArrayItem(durs, i);
+        if (!cJSON_IsNumber(t) || !cJSON_IsNumber(d) ||
+            t->valuedouble < 200 || t->valuedouble > 400 || d->valuedouble < 1 || d->valuedouble > 4032)
+        {
+            return false;
+        }
+        parsed.temp[i] = (uint16_t)t->valuedouble;
+        parsed.dur[i] = (uint16_t)d->valuedouble;
+    }
+
+    *profile = parsed;
+    return true;
+}
+
+uint32_t json_uint_in_range(const cJSON *obj, const char *key, uint32_t min, uint32_t max, uint32_t fallback)
+{
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(obj, key);
+    if (cJSON_IsNumber(item) && item->valuedouble >= min && item->valuedouble <= max)
+    {
+        return (uint32_t)item->valuedouble;
+    }
+    return fallback;
+}
+
+// Field by field: memcmp would also compare padding and unused profile steps
+static bool device_config_equal(const device_config_t *a, const device_config_t *b)
+{
+    if (a->sleep_sec != b->sleep_sec || a->heatr_temp != b->heatr_temp || a->heatr_dur != b->heatr_dur ||
+        a->profile.len != b->profile.len)
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < a->profile.len; i++)
+    {
+        if (a->profile.temp[i] != b->profile.temp[i] || a->profile.dur[i] != b->profile.dur[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Applies the control block the server returns with every upload
+bool parse_server_control(const char *body, server_control_t *control)
+{
+    cJSON *root = cJSON_Parse(body);
+    if (!root)
+    {
+        ESP_LOGE(TAG, "Failed to parse server response");
+        return false;
+    }
+
+    const cJSON *ctl = cJSON_GetObjectItemCaseSensitive(root, "ctl");
+    if (!cJSON_IsObject(ctl))
+    {
+        cJSON_Delete(root);
+        return false;
+    }
+
+    const cJSON *fw = cJSON_GetObjectItemCaseSensitive(ctl, "fw");
+    const cJSON *fw_crc = cJSON_GetObjectItemCaseSensitive(ctl, "fw_crc");
+    if (cJSON_IsString(fw) && cJSON_IsString(fw_crc))
+    {
+        snprintf(control->fw_version, sizeof(control->fw_version), "%s", fw->valuestring);
+        control->fw_crc = strtoul(fw_crc->valuestring, NULL, 16);
+    }
+    else
+    {
+        snprintf(control->fw_version, sizeof(control->fw_version), "%s", FIRMWARE_VERSION);
+    }
+
+    device_config_t cfg = {
+        .sleep_sec = json_uint_in_range(ctl, "sleep", 10, 86400, device_config.sleep_sec),
+        .heatr_temp = json_uint_in_range(ctl, "heatr_temp", 200, 400, device_config.heatr_temp),
+        .heatr_dur = json_uint_in_range(ctl, "heatr_dur", 1, 4032, device_config.heatr_dur),
+        .profile = device_config.profile,
+    };
+
+    const cJSON *prof = cJSON_GetObjectItemCaseSensitive(ctl, "heatr_prof");
+    if (prof && !parse_heater_profile(prof, &cfg.profile))
+    {
+        ESP_LOGW(TAG, "Ignoring invalid heater profile");
+    }
+
+    // Only touch flash when the fleet config actually changed
+    if (!device_config_equal(&cfg, &device_config))
+    {
+        device_config = cfg;
+        save_device_config();
+        ESP_LOGI(TAG, "Config updated: sleep %lus, heater %u°C / %ums, profile %u steps",
+                 cfg.sleep_sec, cfg.heatr_temp, cfg.heatr_dur, cfg.profile.len);
+    }
+
+    cJSON_Delete(root);
+    control->valid = true;
+    return true;
+}
+
+// Upload body under construction; once a piece does not fit, nothing more is written
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+    bool truncated;
+} json_out_t;
+
+// Takes the return of an snprintf-style formatter that wrote at out->buf + out->len
+static void json_appended(json_out_t *out, int n)
+{
+    if (n < 0 || (size_t)n >= out->size - out->len)
+    {
+        out->truncated = true;
+        out->buf[out->len] = '\0';
+        return;
+    }
+    out->len += n;
+}
+
+static void json_appendf(json_out_t *out, const char *fmt, ...)
+{
+    if (out->truncated)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+    va_end(args);
+    json_appended(out, n);
+}
+
+bool send_sensor_data(const sensor_sample_t *sample, const sample_stats_t *stats, server_control_t *control)
+{
+    // Static: the wake cycle runs this on the main task, whose stack is small
+    static char post_data[1024];
+    json_out_t out = {.buf = post_data, .size = sizeof(post_data)};
+    json_appendf(&out,
+                 "{\"id\": \"%s\", \"fw\": \"%s\", \"temperature\": %.2f, \"humidity\": %.2f, "
+                 "\"pressure\": %.2f, \"gas_resistance\": %d",
+                 device_id, FIRMWARE_VERSION, sample->temperature, sample->humidity, sample->pressure,
+                 sample->gas_resistance);
+    if (sample->n_gas > 0)
+    {
+        json_appendf(&out, ", \"gas_fp\": [");
+        for (uint8_t i = 0; i < sample->n_gas; i++)
+        {
+            json_appendf(&out, "%s%lu", i ? "," : "", sample->gas_fp[i]);
+        }
+        json_appendf(&out, "]");
+    }
+    json_appendf(&out, ", \"iaq\": %.1f, \"iaq_acc\": %u", sample->iaq.iaq, sample->iaq.accuracy);
+    if (sample->timestamp)
+    {
+        json_appendf(&out, ", \"ts\": %lu", sample->timestamp);
+    }
+    if (stats && stats->n > 0)
+    {
+        json_appendf(&out, ", ");
+        if (!out.truncated)
+        {
+            json_appended(&out, sample_stats_format_json(stats, out.buf + out.len, out.size - out.len));
+        }
+    }
+    json_appendf(&out, ", ");
+    if (!out.truncated)
+    {
+        json_appended(&out, net_health_format_json(out.buf + out.len, out.size - out.len));
+    }
+    json_appendf(&out, "}");
+    if (out.truncated)
+    {
+        // Posting the cut-off body would only get a 400; the journal keeps the sample
+        ESP_LOGE(TAG, "Upload body does not fit in %u bytes, not sent", (unsigned)sizeof(post_data));
+        return false;
+    }
+
+    http_response_t response = {0};
     esp_http_client_config_t config = {
         .url = SERVER_URL,
         .method = HTTP_METHOD_POST,
         .cert_pem = (const char *)cert_pem_start,
         .timeout_ms = 10000,
+        .event_handler = http_response_handler,
+        .user_data = &response,
     };
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_post_field(client, post_data, strlen(post_data));
+    esp_http_client_set_post_field(client, post_data, out.len);
     esp_http_client_set_header(client, "Content-Type", "application/json");
 
+    net_health_http_start();
     esp_err_t err = esp_http_client_perform(client);
     bool success = false;
+    int status_code = 0;
 
     if (err == ESP_OK)
     {
-        int status_code = esp_http_client_get_status_code(client);
-        printf("HTTP POST Status = %d\n", status_code);
+        status_code = esp_http_client_get_status_code(client);
+        ESP_LOGD(TAG, "HTTP POST Status = %d", status_code);
         success = (status_code >= 200 && status_code < 300);
     }
     else
     {
-        printf("HTTP POST failed: %s\n", esp_err_to_name(err));
+        ESP_LOGE(TAG, "HTTP POST failed: %s", esp_err_to_name(err));
     }
+    net_health_http_done(err, status_code);
 
     esp_http_client_cleanup(client);
+
+    if (success)
+    {
+        parse_server_control(response.buf, control);
+    }
     return success;
 }
 
-bool is_new_firmware_available()
+// Keeps a sample that could not be uploaded for a later bulk drain
+void journal_sample(const sensor_sample_t *sample)
 {
+    journal_record_t rec = {
+        .timestamp = sample->timestamp,
+        .temperature = sample->temperature,
+        .humidity = sample->humidity,
+        .pressure = sample->pressure,
+        .gas_resistance = sample->gas_resistance,
+        .iaq_x10 = (uint16_t)(sample->iaq.iaq * 10.0f),
+        .iaq_accuracy = sample->iaq.accuracy,
+    };
+    if (journal_append(&rec))
+    {
+        ESP_LOGD(TAG, "Sample journaled as seq %lu", rec.seq);
+    }
+}
+
+// Uploads journaled samples in binary batches until the server has all of them
+void drain_journal(void)
+{
+    static journal_record_t batch[JOURNAL_DRAIN_BATCH];
+    http_response_t response;
     esp_http_client_config_t config = {
-        .url = VERSION_URL,
-        .timeout_ms = 10000,
+        .url = SERVER_BATCH_URL,
+        .method = HTTP_METHOD_POST,
         .cert_pem = (const char *)cert_pem_start,
-        .skip_cert_common_name_check = true,
+        .timeout_ms = 10000,
+        .event_handler = http_response_handler,
+        .user_data = &response,
+        .keep_alive_enable = true,
     };
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_err_t err = esp_http_client_open(client, 0);
-    if (err != ESP_OK)
+    esp_http_client_set_header(client, "Content-Type", "application/octet-stream");
+    // Journal records are fixed-size and carry no identity of their own
+    esp_http_client_set_header(client, "X-Device-Id", device_id);
+    esp_http_client_set_header(client, "X-Firmware-Version", FIRMWARE_VERSION);
+
+    size_t n;
+    while ((n = journal_read(journal_acked_seq(), batch, JOURNAL_DRAIN_BATCH)) > 0)
     {
-        printf("Failed to open HTTP client: %s\n", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
-        return false;
+        response.len = 0;
+        response.buf[0] = '\0';
+        esp_http_client_set_post_field(client, (const char *)batch, n * sizeof(batch[0]));
+
+        esp_err_t err = esp_http_client_perform(client);
+        int status_code = esp_http_client_get_status_code(client);
+        if (err != ESP_OK || status_code != 200)
+        {
+            ESP_LOGE(TAG, "Journal drain failed: %s (HTTP %d)", esp_err_to_name(err), status_code);
+            break;
+        }
+
+        cJSON *root = cJSON_Parse(response.buf);
+        const cJSON *ack = cJSON_GetObjectItem(root, "ack");
+        bool acked = cJSON_IsNumber(ack) && ack->valuedouble >= batch[0].seq;
+        if (acked)
+        {
+            journal_ack((uint32_t)ack->valuedouble);
+            ESP_LOGI(TAG, "Journal drained up to seq %lu", journal_acked_seq());
+        }
+        cJSON_Delete(root);
+        if (!acked)
+        {
+            ESP_LOGE(TAG, "Server did not acknowledge journal batch");
+            break;
+        }
     }
 
-    int content_length = esp_http_client_fetch_headers(client);
-    if (content_length < 0)
+    esp_http_client_cleanup(client);
+}
+
+ota_resume_result_t perform_ota_update(uint32_t image_crc)
+{
+    ESP_LOGI(TAG, "Starting OTA update...");
+
+    ota_resume_result_t result = ota_resume_step(OTA_URL, (const char *)cert_pem_start, image_crc,
+                                                 OTA_WAKE_BUDGET_MS);
+    if (result == OTA_RESUME_DONE)
     {
-        printf("Failed to fetch headers\n");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return false;
+        ESP_LOGI(TAG, "OTA update successful, restarting...");
+        esp_restart();
     }
-
-    int status_code = esp_http_client_get_status_code(client);
-    if (status_code != 200)
+    else if (result == OTA_RESUME_IN_PROGRESS)
     {
-        printf("HTTP request failed with status code: %d\n", status_code);
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return false;
+        ESP_LOGI(TAG, "OTA download will continue on the next wake");
     }
-
-    char *buf = malloc(content_length + 1);
-    if (!buf)
+    else
     {
-        printf("Failed to allocate memory\n");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return false;
+        ESP_LOGE(TAG, "OTA update failed");
     }
+    return result;
+}
+
+bool perform_delta_ota_update()
+{
+    ESP_LOGI(TAG, "Trying delta OTA update...");
 
-    int data_read = esp_http_client_read_response(client, buf, content_length);
-    if (data_read < 0)
+    if (ota_delta_update(DELTA_OTA_URL, (const char *)cert_pem_start))
     {
-        printf("Failed to read response\n");
-        free(buf);
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return false;
+        ESP_LOGI(TAG, "Delta OTA update successful, restarting...");
+        esp_restart();
+        return true;
     }
 
-    buf[data_read] = '\0';
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+    ESP_LOGW(TAG, "Delta OTA not possible, falling back to full image");
+    return false;
+}
 
-    cJSON *root = cJSON_Parse(buf);
-    if (!root)
+static bool ota_reject_matches(const server_control_t *control)
+{
+    return ota_reject.magic == OTA_REJECT_MAGIC && ota_reject.fw_crc == control->fw_crc &&
+           strcmp(ota_reject.fw_version, control->fw_version) == 0;
+}
+
+// True while a bad image is backed off; counts this announcement against it
+static bool ota_skip_rejected(const server_control_t *control)
+{
+    if (!ota_reject_matches(control))
     {
-        printf("Failed to parse JSON\n");
-        free(buf);
+        // A new image gets a fresh chance
+        ota_reject.magic = 0;
         return false;
     }
-
-    const cJSON *version = cJSON_GetObjectItemCaseSensitive(root, "version");
-    bool is_new = false;
-
-    if (cJSON_IsString(version) && (version->valuestring != NULL))
+    if (ota_reject.skip == 0)
     {
-        printf("Server version: %s, Current: %s\n", version->valuestring, FIRMWARE_VERSION);
-        is_new = (strcmp(FIRMWARE_VERSION, version->valuestring) != 0);
+        return false;
     }
-
-    free(buf);
-    cJSON_Delete(root);
-    return is_new;
+    ota_reject.skip--;
+    ESP_LOGW(TAG, "Firmware %s (crc %08lx) failed verification before, retrying in %u uploads",
+             control->fw_version, control->fw_crc, ota_reject.skip);
+    return true;
 }
 
-bool perform_ota_update()
+static void ota_record_rejected(const server_control_t *control)
 {
-    printf("Starting OTA update...\n");
-
-    esp_http_client_config_t config = {
-        .url = OTA_URL,
-        .timeout_ms = 30000,
-        .cert_pem = (const char *)cert_pem_start,
-        .skip_cert_common_name_check = true,
-    };
+    if (!ota_reject_matches(control))
+    {
+        memset(&ota_reject, 0, sizeof(ota_reject));
+        ota_reject.magic = OTA_REJECT_MAGIC;
+        ota_reject.fw_crc = control->fw_crc;
+        snprintf(ota_reject.fw_version, sizeof(ota_reject.fw_version), "%s", control->fw_version);
+    }
+    uint32_t skip = (uint32_t)OTA_REJECT_SKIP_MIN << (ota_reject.failures < 8 ? ota_reject.failures : 8);
+    ota_reject.skip = skip < OTA_REJECT_SKIP_MAX ? skip : OTA_REJECT_SKIP_MAX;
+    ota_reject.failures++;
+    ESP_LOGE(TAG, "Firmware %s rejected %u times, skipping it for %u uploads", control->fw_version,
+             ota_reject.failures, ota_reject.skip);
+}
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
-    };
+void handle_server_control(const server_control_t *control)
+{
+    if (!control->valid)
+    {
+        return;
+    }
 
-    esp_err_t ret = esp_https_ota(&ota_config);
-    if (ret == ESP_OK)
+    bool update = strcmp(control->fw_version, FIRMWARE_VERSION) != 0 && !ota_skip_rejected(control);
+    wake_plan_set_ota_due(update);
+    if (!update)
     {
-        printf("OTA update successful, restarting...\n");
-        esp_restart();
-        return true;
+        return;
     }
-    else
+
+    ESP_LOGI(TAG, "Server announces firmware %s, running %s", control->fw_version, FIRMWARE_VERSION);
+    // A half-downloaded full image is cheaper to finish than a fresh delta
+    if ((ota_resume_pending() || !perform_delta_ota_update()) &&
+        perform_ota_update(control->fw_crc) == OTA_RESUME_REJECTED)
     {
-        printf("OTA update failed: %s\n", esp_err_to_name(ret));
-        return false;
+        ota_record_rejected(control);
     }
 }
 
 void enter_deep_sleep(void)
 {
-    printf("Entering deep sleep for %d seconds...\n", DEEP_SLEEP_DURATION_SEC);
+    ESP_LOGI(TAG, "Entering deep sleep for %lu seconds...", device_config.sleep_sec);
+    ota_verify_hold();
 
-    esp_sleep_enable_timer_wakeup(DEEP_SLEEP_DURATION_SEC * 1000000ULL);
+    esp_sleep_enable_timer_wakeup(device_config.sleep_sec * 1000000ULL);
+    sleep_end_rtc_us = esp_rtc_get_time_us() + device_config.sleep_sec * 1000000ULL;
 
     // rtc_gpio_isolate(GPIO_NUM_12);
     // rtc_gpio_isolate(GPIO_NUM_15);
@@ -380,142 +936,482 @@ void enter_deep_sleep(void)
     esp_deep_sleep_start();
 }
 
-uint32_t get_wake_count(void)
+static bool wake_counter_valid(void)
 {
-    nvs_handle_t nvs_handle;
-    uint32_t wake_count = 0;
+    return wake_counter.magic == WAKE_COUNTER_MAGIC && wake_counter.count_inv == ~wake_counter.count;
+}
 
+static void checkpoint_wake_count(void)
+{
+    nvs_handle_t nvs_handle;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK)
     {
-        printf("Failed to open NVS: %s\n", esp_err_to_name(err));
-        return wake_count;
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return;
     }
 
-    err = nvs_get_u32(nvs_handle, NVS_WAKE_COUNT_KEY, &wake_count);
-    if (err == ESP_ERR_NVS_NOT_FOUND)
+    err = nvs_set_u32(nvs_handle, NVS_WAKE_COUNT_KEY, wake_counter.count);
+    if (err == ESP_OK)
     {
-        printf("Wake count not found, initializing to 0\n");
-        wake_count = 0;
+        err = nvs_commit(nvs_handle);
     }
-    else if (err != ESP_OK)
+    if (err != ESP_OK)
     {
-        printf("Error reading wake count: %s\n", esp_err_to_name(err));
-        wake_count = 0;
+        ESP_LOGE(TAG, "Error saving wake count: %s", esp_err_to_name(err));
     }
-
-    printf("Previous wake count: %lu\n", wake_count);
-
-    wake_count++;
-    err = nvs_set_u32(nvs_handle, NVS_WAKE_COUNT_KEY, wake_count);
-    if (err != ESP_OK)
+    else
     {
-        printf("Error setting wake count: %s\n", esp_err_to_name(err));
+        wake_counter.checkpointed = wake_counter.count;
     }
+    nvs_close(nvs_handle);
+}
 
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK)
+// After anything but a deep-sleep wake, RTC memory may be gone or stale; NVS
+// lags by at most one checkpoint interval, so take whichever count is higher
+static void reconcile_wake_count(esp_reset_reason_t reason)
+{
+    uint32_t stored = 0;
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK)
     {
-        printf("Error committing NVS changes: %s\n", esp_err_to_name(err));
+        nvs_get_u32(nvs_handle, NVS_WAKE_COUNT_KEY, &stored);
+        nvs_close(nvs_handle);
     }
 
-    nvs_close(nvs_handle);
-    printf("Updated wake count: %lu\n", wake_count);
+    uint32_t held = wake_counter_valid() ? wake_counter.count : 0;
+    ESP_LOGI(TAG, "Reset reason %d: wake count %lu in RTC, %lu in NVS", reason, held, stored);
 
-    return wake_count;
+    wake_counter.magic = WAKE_COUNTER_MAGIC;
+    wake_counter.count = held > stored ? held : stored;
+    wake_counter.checkpointed = stored;
 }
 
-void app_main(void)
+// A brownout or crash may repeat before the next interval, so those save right away
+bool wake_count_checkpoint_due(void)
 {
-    esp_sleep_wakeup_cause_t wakeup_reason = esp_sleep_get_wakeup_cause();
+    return esp_reset_reason() != ESP_RST_DEEPSLEEP || !wake_counter_valid() ||
+           wake_counter.count + 1 - wake_counter.checkpointed >= WAKE_COUNT_CHECKPOINT_INTERVAL;
+}
 
-    switch (wakeup_reason)
+uint32_t get_wake_count(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool checkpoint = wake_count_checkpoint_due();
+    if (reason != ESP_RST_DEEPSLEEP || !wake_counter_valid())
     {
-    case ESP_SLEEP_WAKEUP_TIMER:
-        printf("Wakeup from timer\n");
-        break;
-    case ESP_SLEEP_WAKEUP_UNDEFINED:
-    default:
-        printf("Cold boot\n");
-        break;
+        reconcile_wake_count(reason);
     }
 
-    printf("Firmware v%s starting...\n", FIRMWARE_VERSION);
+    wake_counter.count++;
+    wake_counter.count_inv = ~wake_counter.count;
+
+    if (checkpoint)
+    {
+        checkpoint_wake_count();
+    }
 
+    return wake_counter.count;
+}
+
+void init_nvs(void)
+{
+    phase_begin(PHASE_NVS);
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ESP_ERROR_CHECK(nvs_flash_init());
     }
+    phase_end(PHASE_NVS);
+}
 
-    uint32_t wake_count = get_wake_count();
-    printf("Wake count: %lu\n", wake_count);
+void sleep_after_wake(const wake_plan_t *plan)
+{
+    phase_report(plan->reason);
+    enter_deep_sleep();
+}
 
-    i2c_master_init();
+void run_wake_cycle(void)
+{
+    wake_inputs_t inputs = {
+        .cold_boot = esp_reset_reason() != ESP_RST_DEEPSLEEP,
+        .checkpoint_due = wake_count_checkpoint_due(),
+        .config_cached = device_config_cached,
+        .journal_backlog = journal_backlog(),
+        .ota_trial = ota_verify_on_trial(),
+    };
+    wake_plan_t plan;
+    wake_plan_make(&inputs, &plan);
 
-    static uint8_t dev_addr = BME68X_I2C_ADDR_HIGH;
-    gas_sensor.intf = BME68X_I2C_INTF;
-    gas_sensor.intf_ptr = &dev_addr;
-    gas_sensor.read = bme_i2c_read;
-    gas_sensor.write = bme_i2c_write;
-    gas_sensor.delay_us = user_delay_us;
-    gas_sensor.amb_temp = 25;
+    // NVS, netif and the event loop are only brought up when this wake uses them
+    if (plan.nvs)
+    {
+        init_nvs();
+    }
+    ESP_LOGI(TAG, "Wake count: %lu", get_wake_count());
+    if (inputs.cold_boot || !device_config_cached)
+    {
+        load_device_config();
+    }
+    ota_verify_init();
+    journal_init();
 
-    int8_t rslt = bme68x_init(&gas_sensor);
-    if (rslt != BME68X_OK)
+    // Association is the slowest phase, so start it first. The sensor task
+    // measures on core 1 while Wi-Fi associates on core 0; this task blocks
+    // until the reading is done, then waits for the connection to upload it.
+    if (plan.network)
     {
-        printf("BME68x initialization failed: %d\n", rslt);
-        enter_deep_sleep();
-        return;
+        phase_begin(PHASE_WIFI);
+        wifi_start();
     }
 
-    float temp, humidity, pressure;
-    int gas_resistance;
+    static sensor_sample_t sample;
+    bool sample_valid = false;
+    phase_begin(PHASE_SENSOR);
+    if (xTaskCreatePinnedToCore(sensor_task, "sensor", SENSOR_TASK_STACK_SIZE, &sample,
+                                SENSOR_TASK_PRIORITY, NULL, SENSOR_TASK_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start the sensor task");
+    }
+    else if (!(xEventGroupWaitBits(wake_event_group, SENSOR_DONE_BIT, pdFALSE, pdTRUE,
+                                   pdMS_TO_TICKS(SENSOR_TASK_TIMEOUT_MS)) & SENSOR_DONE_BIT))
+    {
+        // The task may still hold the bus, so the driver is left to deep sleep
+        ESP_LOGE(TAG, "Sensor task did not finish within %d ms", SENSOR_TASK_TIMEOUT_MS);
+    }
+    else
+    {
+        i2c_driver_delete(I2C_MASTER_NUM);
+        sample_valid = sample.valid;
+    }
+    phase_end(PHASE_SENSOR);
 
-    if (!read_sensor_data(&temp, &humidity, &pressure, &gas_resistance))
+    if (!sample_valid)
     {
-        printf("Failed to read sensor data\n");
-        enter_deep_sleep();
+        ESP_LOGE(TAG, "Failed to read sensor data");
+        if (plan.network)
+        {
+            wifi_cleanup();
+        }
+        sleep_after_wake(&plan);
         return;
     }
 
-    printf("T: %.2f°C, H: %.2f%%, P: %.2fhPa, G: %dΩ\n",
-           temp, humidity, pressure, gas_resistance);
+    ESP_LOGI(TAG, "T: %.2f°C, H: %.2f%%, P: %.2fhPa, G: %dΩ, IAQ: %.0f (accuracy %u)",
+             sample.temperature, sample.humidity, sample.pressure, sample.gas_resistance,
+             sample.iaq.iaq, sample.iaq.accuracy);
+    bool alert = iaq_alert(&sample.iaq);
+    if (alert)
+    {
+        ESP_LOGW(TAG, "Air quality alert");
+    }
 
-    if (!wifi_init_and_connect())
+    if (!plan.network)
     {
-        printf("WiFi connection failed, going to sleep\n");
+        if (!wake_plan_reading_changed(&plan, sample.temperature, sample.humidity, sample.iaq.iaq, alert))
+        {
+            // Goes up with the next batch drain instead of its own POST
+            journal_sample(&sample);
+            sleep_after_wake(&plan);
+            return;
+        }
+        if (!plan.nvs)
+        {
+            init_nvs();
+        }
+        phase_begin(PHASE_WIFI);
+        wifi_start();
+    }
+
+    if (!wifi_wait_connected())
+    {
+        ESP_LOGW(TAG, "WiFi connection failed, going to sleep");
+        journal_sample(&sample);
         wifi_cleanup();
-        enter_deep_sleep();
+        sleep_after_wake(&plan);
         return;
     }
+    phase_end(PHASE_WIFI);
 
-    bool data_sent = send_sensor_data(temp, humidity, pressure, gas_resistance);
+    phase_begin(PHASE_UPLOAD);
+    server_control_t control = {0};
+    bool data_sent = send_sensor_data(&sample, NULL, &control);
     if (data_sent)
     {
-        printf("Data sent successfully\n");
+        ESP_LOGI(TAG, "Data sent successfully");
+        ota_verify_confirm();
+        wake_plan_uploaded(sample.temperature, sample.humidity, sample.iaq.iaq);
+        if (journal_pending())
+        {
+            drain_journal();
+        }
     }
     else
     {
-        printf("Failed to send data\n");
+        ESP_LOGW(TAG, "Failed to send data");
+        journal_sample(&sample);
+    }
+    // Done after the upload so a slow NTP server never delays the reading
+    if (time_sync_due())
+    {
+        time_sync_now();
     }
+    phase_end(PHASE_UPLOAD);
+
+    handle_server_control(&control);
+
+    wifi_cleanup();
+    sleep_after_wake(&plan);
+}
+
+#if CONFIG_APP_CONTINUOUS_SAMPLING
+// Core 1: acquisition, compensation and aggregation. Never touches the network.
+void sampling_task(void *arg)
+{
+    device_config_t cfg = device_config;
+    sensor_sample_t sample;
+    sample_stats_t stats;
+    uint64_t sum_fp[GAS_SCAN_MAX_STEPS] = {0};
+    iaq_result_t last_iaq = {0};
+    uint32_t period_ts = 0;
 
-    if (wake_count % OTA_CHECK_INTERVAL == 0)
+    sample_stats_reset(&stats);
+
+    if (!sensor_init())
+    {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    TickType_t last_wake = xTaskGetTickCount();
+    TickType_t period_start = last_wake;
+
+    while (true)
+    {
+        while (spsc_queue_pop(&config_queue, &cfg))
+        {
+            ESP_LOGI(TAG, "Sampling config updated: heater %u°C / %ums", cfg.heatr_temp, cfg.heatr_dur);
+        }
+
+        if (read_sensor_data(&sample, &cfg))
+        {
+            iaq_update(sample.humidity, sample.gas_resistance, CONFIG_APP_SAMPLE_PERIOD_MS / 1000.0f, &last_iaq);
+            if (stats.n == 0)
+            {
+                period_ts = sample.timestamp;
+            }
+            struct bme68x_data data = {
+                .temperature = sample.temperature,
+                .humidity = sample.humidity,
+                .pressure = sample.pressure,
+                .gas_resistance = sample.gas_resistance,
+            };
+            sample_stats_add(&stats, &data);
+            for (uint8_t i = 0; i < sample.n_gas; i++)
+            {
+                sum_fp[i] += sample.gas_fp[i];
+            }
+        }
+
+        if (xTaskGetTickCount() - period_start >= pdMS_TO_TICKS(CONFIG_APP_UPLOAD_PERIOD_SEC * 1000))
+        {
+            if (stats.n > 0)
+            {
+                sensor_aggregate_t agg = {
+                    .mean = {
+                        .n_gas = cfg.profile.len,
+                        .iaq = last_iaq,
+                        .timestamp = period_ts, // aggregates are stamped with their first sample
+                        .valid = true,
+                    },
+                    .stats = stats,
+                };
+                for (uint8_t i = 0; i < agg.mean.n_gas; i++)
+                {
+                    agg.mean.gas_fp[i] = (uint32_t)(sum_fp[i] / stats.n);
+                }
+                if (!spsc_queue_push(&sample_queue, &agg))
+                {
+                    ESP_LOGW(TAG, "Sample queue full, dropping aggregate of %lu samples", stats.n);
+                }
+            }
+            sample_stats_reset(&stats);
+            memset(sum_fp, 0, sizeof(sum_fp));
+            period_start = xTaskGetTickCount();
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_APP_SAMPLE_PERIOD_MS));
+    }
+}
+
+static sensor_sample_t *aggregate_means(sensor_aggregate_t *agg)
+{
+    agg->mean.temperature = sample_stats_mean(&agg->stats, STATS_TEMPERATURE);
+    agg->mean.humidity = sample_stats_mean(&agg->stats, STATS_HUMIDITY);
+    agg->mean.pressure = sample_stats_mean(&agg->stats, STATS_PRESSURE);
+    agg->mean.gas_resistance = (int)sample_stats_mean(&agg->stats, STATS_GAS);
+    return &agg->mean;
+}
+
+// Core 0, next to the Wi-Fi and lwIP tasks: TLS and uploads
+void uplink_task(void *arg)
+{
+    float busy[configNUMBER_OF_CORES];
+    sensor_aggregate_t agg;
+    sensor_aggregate_t next;
+    bool config_unsent = false;
+
+    wifi_start();
+    cpu_usage_sample(busy);
+
+    while (true)
     {
-        printf("Checking for OTA update...\n");
-        if (is_new_firmware_available())
+        vTaskDelay(pdMS_TO_TICKS(UPLINK_POLL_MS));
+
+        // Aggregates wait in the queue while the link is down; once it is about
+        // to overflow the oldest goes to the flash journal instead
+        if (!(xEventGroupGetBits(wake_event_group) & WIFI_CONNECTED_BIT))
         {
-            perform_ota_update();
+            if (spsc_queue_count(&sample_queue) >= SAMPLE_QUEUE_LEN - 1 && spsc_queue_pop(&sample_queue, &agg))
+            {
+                aggregate_means(&agg);
+                journal_sample(&agg.mean);
+            }
+            continue;
+        }
+        if (!spsc_queue_pop(&sample_queue, &agg))
+        {
+            continue;
+        }
+
+        // After an outage, fold the backlog into one upload; fingerprint and IAQ are the newest
+        uint32_t first_ts = agg.mean.timestamp;
+        while (spsc_queue_pop(&sample_queue, &next))
+        {
+            sample_stats_merge(&next.stats, &agg.stats);
+            agg = next;
+        }
+        agg.mean.timestamp = first_ts;
+
+        sensor_sample_t *sample = aggregate_means(&agg);
+
+        ESP_LOGI(TAG, "T: %.2f°C, H: %.2f%%, P: %.2fhPa, G: %dΩ (mean of %lu), IAQ: %.0f (accuracy %u)",
+                 sample->temperature, sample->humidity, sample->pressure, sample->gas_resistance,
+                 agg.stats.n, sample->iaq.iaq, sample->iaq.accuracy);
+
+        device_config_t previous = device_config;
+        server_control_t control = {0};
+        if (!send_sensor_data(sample, &agg.stats, &control))
+        {
+            ESP_LOGW(TAG, "Failed to send data");
+            journal_sample(sample);
+            ota_verify_attempt();
         }
         else
         {
-            printf("No firmware update available\n");
+            ota_verify_confirm();
+            if (journal_pending())
+            {
+                drain_journal();
+            }
+        }
+        if (time_sync_due())
+        {
+            time_sync_now();
+        }
+
+        // A full queue means the sampling task is stalled; offer the config again next round
+        if (config_unsent || !device_config_equal(&previous, &device_config))
+        {
+            config_unsent = !spsc_queue_push(&config_queue, &device_config);
+            if (config_unsent)
+            {
+                ESP_LOGW(TAG, "Config queue full, sampling keeps its current config for now");
+            }
+        }
+        handle_server_control(&control);
+
+        cpu_usage_sample(busy);
+        for (int core = 0; core < configNUMBER_OF_CORES; core++)
+        {
+            ESP_LOGD(TAG, "CPU%d: %.1f%% busy", core, busy[core]);
         }
     }
+}
 
-    wifi_cleanup();
-    i2c_driver_delete(I2C_MASTER_NUM);
+void start_continuous_sampling(void)
+{
+    // Without the queues or either task the node would sample or upload nothing, silently
+    if (!spsc_queue_init(&sample_queue, sample_queue_storage, sizeof(sensor_aggregate_t), SAMPLE_QUEUE_LEN) ||
+        !spsc_queue_init(&config_queue, config_queue_storage, sizeof(device_config_t), CONFIG_QUEUE_LEN))
+    {
+        ESP_LOGE(TAG, "Failed to set up the sample and config queues");
+        abort();
+    }
+    journal_init();
 
-    enter_deep_sleep();
-}
\ No newline at end of file
+    if (xTaskCreatePinnedToCore(sampling_task, "sampling", SENSOR_TASK_STACK_SIZE, NULL,
+                                SENSOR_TASK_PRIORITY, NULL, SENSOR_TASK_CORE) != pdPASS ||
+        xTaskCreatePinnedToCore(uplink_task, "uplink", UPLINK_TASK_STACK_SIZE, NULL,
+                                UPLINK_TASK_PRIORITY, NULL, UPLINK_TASK_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start the sampling and uplink tasks");
+        abort();
+    }
+}
+#endif
+
+#if CONFIG_APP_BOOT_TIME_MARKER
+// The RTC timer restarts on power-on and EN resets and keeps running through
+// deep sleep, so it measures ROM, bootloader and startup time in both cases
+static void report_boot_time(void)
+{
+    uint64_t now = esp_rtc_get_time_us();
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    if (reason == ESP_RST_DEEPSLEEP && sleep_end_rtc_us != 0 && now > sleep_end_rtc_us)
+    {
+        esp_rom_printf("boot_time: wake %lu us\n", (uint32_t)(now - sleep_end_rtc_us));
+    }
+    else if (reason == ESP_RST_POWERON)
+    {
+        esp_rom_printf("boot_time: reset %lu us\n", (uint32_t)now);
+    }
+}
+#endif
+
+void app_main(void)
+{
+#if CONFIG_APP_BOOT_TIME_MARKER
+    report_boot_time();
+#endif
+
+    esp_sleep_wakeup_cause_t wakeup_reason = esp_sleep_get_wakeup_cause();
+
+    switch (wakeup_reason)
+    {
+    case ESP_SLEEP_WAKEUP_TIMER:
+        ESP_LOGI(TAG, "Wakeup from timer");
+        break;
+    case ESP_SLEEP_WAKEUP_UNDEFINED:
+    default:
+        ESP_LOGI(TAG, "Cold boot");
+        break;
+    }
+
+    init_device_id();
+    ESP_LOGI(TAG, "Firmware v%s starting on node %s", FIRMWARE_VERSION, device_id);
+
+    wake_event_group = xEventGroupCreate();
+
+#if CONFIG_APP_CONTINUOUS_SAMPLING
+    init_nvs();
+    ESP_LOGI(TAG, "Wake count: %lu", get_wake_count());
+    load_device_config();
+    ota_verify_init();
+    start_continuous_sampling();
+#else
+    run_wake_cycle();
+#endif
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "gas_scan.h"
+
+static const char *TAG = "gas_scan";
+
+// Extra polls allowed beyond one per step before the scan is abandoned
+#define GAS_SCAN_EXTRA_POLLS 2
+
+bool gas_scan_run(struct bme68x_dev *dev, struct bme68x_conf *conf,
+                  const gas_profile_t *profile, gas_scan_result_t *result)
+{
+    if (profile->len == 0 || profile->len > GAS_SCAN_MAX_STEPS)
+    {
+        return false;
+    }
+
+    // The driver takes non-const profile pointers
+    uint16_t temp_prof[GAS_SCAN_MAX_STEPS];
+    uint16_t dur_prof[GAS_SCAN_MAX_STEPS];
+    memcpy(temp_prof, profile->temp, sizeof(temp_prof));
+    memcpy(dur_prof, profile->dur, sizeof(dur_prof));
+
+    struct bme68x_heatr_conf heatr_conf = {
+        .enable = BME68X_ENABLE,
+        .heatr_temp_prof = temp_prof,
+        .heatr_dur_prof = dur_prof,
+        .profile_len = profile->len,
+    };
+
+    int8_t rslt = bme68x_set_heatr_conf(BME68X_SEQUENTIAL_MODE, &heatr_conf, dev);
+    if (rslt == BME68X_OK)
+    {
+        rslt = bme68x_set_op_mode(BME68X_SEQUENTIAL_MODE, dev);
+    }
+    if (rslt != BME68X_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start heater profile scan: %d", rslt);
+        return false;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->len = profile->len;
+
+    uint32_t meas_dur_us = bme68x_get_meas_dur(BME68X_SEQUENTIAL_MODE, conf, dev);
+    uint16_t all_steps = (1u << profile->len) - 1;
+    uint16_t seen = 0;
+    struct bme68x_data data[3];
+    uint8_t n_fields;
+
+    for (uint8_t poll = 0; poll < profile->len + GAS_SCAN_EXTRA_POLLS && seen != all_steps; poll++)
+    {
+        // Wait for the step we expect next; later steps arrive in later polls
+        uint8_t step = poll < profile->len ? poll : profile->len - 1;
+        dev->delay_us(meas_dur_us + profile->dur[step] * 1000, dev->intf_ptr);
+
+        if (bme68x_get_data(BME68X_SEQUENTIAL_MODE, data, &n_fields, dev) != BME68X_OK)
+        {
+            continue;
+        }
+
+        for (uint8_t i = 0; i < n_fields; i++)
+        {
+            uint8_t idx = data[i].gas_index;
+            if (!(data[i].status & BME68X_NEW_DATA_MSK) || idx >= profile->len)
+            {
+                continue;
+            }
+
+            seen |= 1u << idx;
+            result->temperature = data[i].temperature;
+            result->humidity = data[i].humidity;
+            result->pressure = data[i].pressure;
+            if ((data[i].status & BME68X_GASM_VALID_MSK) && (data[i].status & BME68X_HEAT_STAB_MSK))
+            {
+                result->gas[idx] = (uint32_t)data[i].gas_resistance;
+            }
+        }
+    }
+
+    bme68x_set_op_mode(BME68X_SLEEP_MODE, dev);
+
+    if (seen != all_steps)
+    {
+        ESP_LOGW(TAG, "Heater profile scan incomplete: got steps 0x%03x of 0x%03x", seen, all_steps);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef GAS_SCAN_H
+#define GAS_SCAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bme68x.h"
+
+// The BME68x holds at most 10 heater set-points
+#define GAS_SCAN_MAX_STEPS 10
+
+typedef struct
+{
+    uint8_t len; // 0 disables scanning, forced mode is used instead
+    uint16_t temp[GAS_SCAN_MAX_STEPS]; // heater temperature per step in degC
+    uint16_t dur[GAS_SCAN_MAX_STEPS];  // heating duration per step in ms
+} gas_profile_t;
+
+typedef struct
+{
+    float temperature;
+    float humidity;
+    float pressure;
+    uint8_t len;
+    uint32_t gas[GAS_SCAN_MAX_STEPS]; // resistance per gas_index, 0 if the heater did not stabilise
+} gas_scan_result_t;
+
+/*
+ * Runs one pass of the heater profile in BME68X_SEQUENTIAL_MODE with the
+ * oversampling/filter settings already applied by bme68x_set_conf, and
+ * collects one gas resistance per profile step into a fingerprint. Puts the
+ * sensor back to sleep before returning. Returns false if any step produced
+ * no data.
+ */
+bool gas_scan_run(struct bme68x_dev *dev, struct bme68x_conf *conf,
+                  const gas_profile_t *profile, gas_scan_result_t *result);
+
+#endif
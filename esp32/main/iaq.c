@@ -0,0 +1,95 @@
+#include <math.h>
+#include <string.h>
+#include "esp_attr.h"
+
+#include "iaq.h"
+
+#define IAQ_STATE_MAGIC 0x49415131 // "IAQ1"
+
+// MOX resistance drops by roughly 3.5 % per %RH; fold that out before tracking
+#define IAQ_HUM_REF 40.0f
+#define IAQ_HUM_SLOPE 0.035f
+#define IAQ_HUM_WEIGHT 25.0f
+#define IAQ_GAS_WEIGHT 75.0f
+
+// Baseline rises quickly towards cleaner air and sinks slowly with sensor ageing
+#define IAQ_TAU_UP_SEC (30 * 60)
+#define IAQ_TAU_DOWN_SEC (24 * 60 * 60)
+#define IAQ_TAU_VAR_SEC (60 * 60)
+
+#define IAQ_WARMUP_SEC (5 * 60)
+#define IAQ_LEARNING_SEC (60 * 60)
+#define IAQ_CALIBRATED_SEC (12 * 60 * 60)
+#define IAQ_STABLE_VAR 0.04f // (log-resistance std dev 0.2)^2
+
+#define IAQ_ALERT_LEVEL 200.0f
+
+typedef struct
+{
+    uint32_t magic;
+    float observed_sec;
+    float baseline; // compensated log resistance of clean air
+    float var;      // moving variance of readings around the baseline
+} iaq_state_t;
+
+static RTC_DATA_ATTR iaq_state_t state;
+
+static float ema_alpha(float dt_sec, float tau_sec)
+{
+    return 1.0f - expf(-dt_sec / tau_sec);
+}
+
+void iaq_update(float humidity, uint32_t gas_resistance, float dt_sec, iaq_result_t *result)
+{
+    if (gas_resistance == 0)
+    {
+        // Heater did not stabilise, so this reading says nothing about the air
+        result->iaq = 0;
+        result->accuracy = 0;
+        return;
+    }
+
+    float x = logf((float)gas_resistance) + IAQ_HUM_SLOPE * (humidity - IAQ_HUM_REF);
+
+    if (state.magic != IAQ_STATE_MAGIC)
+    {
+        memset(&state, 0, sizeof(state));
+        state.magic = IAQ_STATE_MAGIC;
+        state.baseline = x;
+    }
+    else
+    {
+        float dev = x - state.baseline;
+        state.baseline += ema_alpha(dt_sec, dev > 0 ? IAQ_TAU_UP_SEC : IAQ_TAU_DOWN_SEC) * dev;
+        state.var += ema_alpha(dt_sec, IAQ_TAU_VAR_SEC) * (dev * dev - state.var);
+        state.observed_sec += dt_sec;
+    }
+
+    float hum_span = humidity < IAQ_HUM_REF ? IAQ_HUM_REF : 100.0f - IAQ_HUM_REF;
+    float hum_score = IAQ_HUM_WEIGHT * (1.0f - fminf(1.0f, fabsf(humidity - IAQ_HUM_REF) / hum_span));
+    float gas_score = IAQ_GAS_WEIGHT * expf(fminf(0.0f, x - state.baseline));
+
+    result->iaq = 5.0f * (100.0f - hum_score - gas_score);
+
+    if (state.observed_sec < IAQ_WARMUP_SEC)
+    {
+        result->accuracy = 0;
+    }
+    else if (state.observed_sec < IAQ_LEARNING_SEC)
+    {
+        result->accuracy = 1;
+    }
+    else if (state.observed_sec < IAQ_CALIBRATED_SEC || state.var > IAQ_STABLE_VAR)
+    {
+        result->accuracy = 2;
+    }
+    else
+    {
+        result->accuracy = 3;
+    }
+}
+
+bool iaq_alert(const iaq_result_t *result)
+{
+    return result->accuracy >= 1 && result->iaq >= IAQ_ALERT_LEVEL;
+}
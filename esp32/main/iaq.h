@@ -0,0 +1,25 @@
+#ifndef IAQ_H
+#define IAQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+    float iaq;        // 0 (clean air baseline) .. 500 (very poor)
+    uint8_t accuracy; // 0 warm-up, 1 learning, 2 baseline found, 3 calibrated
+} iaq_result_t;
+
+/*
+ * Feeds one reading into the IAQ estimator. The gas-resistance baseline and
+ * its spread are exponential moving statistics of the humidity-compensated
+ * log resistance, kept in RTC memory so they survive deep sleep. dt_sec is
+ * the time since the previous reading and scales the filter constants, so
+ * the same code serves the 5-minute wake cycle and 1 Hz sampling.
+ */
+void iaq_update(float humidity, uint32_t gas_resistance, float dt_sec, iaq_result_t *result);
+
+// True when the reading is trustworthy and bad enough to report right away
+bool iaq_alert(const iaq_result_t *result);
+
+#endif
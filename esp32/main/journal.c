@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "esp_log.h"
+
+#include "journal.h"
+
+static const char *TAG = "journal";
+
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_NVS_NAMESPACE "t_jrnl"
+#define JOURNAL_NVS_ACK_KEY "ack"
+
+#define JOURNAL_SECTOR_SIZE 4096
+#define JOURNAL_HEADER_SIZE 32
+#define JOURNAL_RECORD_SIZE sizeof(journal_record_t)
+#define JOURNAL_RECORDS_PER_SECTOR ((JOURNAL_SECTOR_SIZE - JOURNAL_HEADER_SIZE) / JOURNAL_RECORD_SIZE)
+#define JOURNAL_SECTOR_MAGIC 0x4a524e31 // "JRN1"
+#define JOURNAL_STATE_MAGIC 0x4a535431 // "JST1"
+#define JOURNAL_ERASED 0xffffffff
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t first_seq; // seq of slot 0; slot i always holds first_seq + i
+    uint32_t erase_count;
+    uint32_t crc;
+} journal_sector_header_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t head_sector; // sector currently being filled, or JOURNAL_ERASED if none yet
+    uint32_t head_slot;   // next free slot in head_sector
+    uint32_t head_first_seq;
+    uint32_t acked_seq;
+} journal_state_t;
+
+_Static_assert(sizeof(journal_record_t) == 32, "journal record layout is shared with the server");
+
+static RTC_DATA_ATTR journal_state_t state;
+static const esp_partition_t *partition;
+static uint32_t n_sectors;
+
+static uint32_t record_crc(const journal_record_t *rec)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)rec, offsetof(journal_record_t, crc));
+}
+
+static size_t slot_offset(uint32_t sector, uint32_t slot)
+{
+    return sector * JOURNAL_SECTOR_SIZE + JOURNAL_HEADER_SIZE + slot * JOURNAL_RECORD_SIZE;
+}
+
+static bool read_header(uint32_t sector, journal_sector_header_t *hdr)
+{
+    if (esp_partition_read(partition, sector * JOURNAL_SECTOR_SIZE, hdr, sizeof(*hdr)) != ESP_OK)
+    {
+        return false;
+    }
+    return hdr->magic == JOURNAL_SECTOR_MAGIC &&
+           hdr->crc == esp_rom_crc32_le(0, (const uint8_t *)hdr, offsetof(journal_sector_header_t, crc));
+}
+
+static uint32_t next_seq(void)
+{
+    // An empty log continues after the last acked seq so a reflashed partition isn't mistaken for drained
+    return state.head_sector == JOURNAL_ERASED ? state.acked_seq + 1 : state.head_first_seq + state.head_slot;
+}
+
+static uint32_t load_acked_seq(void)
+{
+    uint32_t acked = 0;
+    nvs_handle_t nvs_handle;
+    if (nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK)
+    {
+        nvs_get_u32(nvs_handle, JOURNAL_NVS_ACK_KEY, &acked);
+        nvs_close(nvs_handle);
+    }
+    return acked;
+}
+
+// Cold boot: the newest valid sector is the head, the slot after its last written one the write position
+static void rebuild_state(void)
+{
+    memset(&state, 0, sizeof(state));
+    state.head_sector = JOURNAL_ERASED;
+
+    journal_sector_header_t hdr;
+    for (uint32_t i = 0; i < n_sectors; i++)
+    {
+        if (read_header(i, &hdr) && (state.head_sector == JOURNAL_ERASED || hdr.first_seq > state.head_first_seq))
+        {
+            state.head_sector = i;
+            state.head_first_seq = hdr.first_seq;
+        }
+    }
+
+    if (state.head_sector != JOURNAL_ERASED)
+    {
+        // A failed write can leave an erased slot before written ones; writing there again would be out of order
+        uint32_t seq;
+        for (uint32_t slot = 0; slot < JOURNAL_RECORDS_PER_SECTOR; slot++)
+        {
+            if (esp_partition_read(partition, slot_offset(state.head_sector, slot), &seq, sizeof(seq)) == ESP_OK &&
+                seq != JOURNAL_ERASED)
+            {
+                state.head_slot = slot + 1;
+            }
+        }
+    }
+
+    state.acked_seq = load_acked_seq();
+    state.magic = JOURNAL_STATE_MAGIC;
+    ESP_LOGI(TAG, "Journal: %lu sectors, next seq %lu, acked seq %lu", n_sectors, next_seq(), state.acked_seq);
+}
+
+bool journal_init(void)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                         JOURNAL_PARTITION_LABEL);
+    if (!partition)
+    {
+        ESP_LOGW(TAG, "No journal partition, offline buffering disabled");
+        return false;
+    }
+    n_sectors = partition->size / JOURNAL_SECTOR_SIZE;
+
+    if (state.magic != JOURNAL_STATE_MAGIC || (state.head_sector != JOURNAL_ERASED && state.head_sector >= n_sectors))
+    {
+        rebuild_state();
+    }
+    return true;
+}
+
+static bool open_next_sector(void)
+{
+    uint32_t sector = state.head_sector == JOURNAL_ERASED ? 0 : (state.head_sector + 1) % n_sectors;
+    journal_sector_header_t hdr;
+    uint32_t erase_count = read_header(sector, &hdr) ? hdr.erase_count + 1 : 1;
+
+    esp_err_t err = esp_partition_erase_range(partition, sector * JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Journal erase failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    hdr.magic = JOURNAL_SECTOR_MAGIC;
+    hdr.first_seq = next_seq();
+    hdr.erase_count = erase_count;
+    hdr.crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(journal_sector_header_t, crc));
+    err = esp_partition_write(partition, sector * JOURNAL_SECTOR_SIZE, &hdr, sizeof(hdr));
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Journal header write failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    state.head_sector = sector;
+    state.head_slot = 0;
+    state.head_first_seq = hdr.first_seq;
+    return true;
+}
+
+bool journal_append(journal_record_t *rec)
+{
+    if (!partition)
+    {
+        return false;
+    }
+
+    if ((state.head_sector == JOURNAL_ERASED || state.head_slot >= JOURNAL_RECORDS_PER_SECTOR) &&
+        !open_next_sector())
+    {
+        return false;
+    }
+
+    rec->seq = next_seq();
+    rec->crc = record_crc(rec);
+    // The slot is consumed even if the write fails so seq and position stay in step;
+    // readers skip the hole it leaves
+    esp_err_t err = esp_partition_write(partition, slot_offset(state.head_sector, state.head_slot), rec,
+                                        sizeof(*rec));
+    state.head_slot++;
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Journal write failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+// Oldest sector that still holds a record after after_seq
+static bool find_start(uint32_t after_seq, uint32_t *sector, journal_sector_header_t *found)
+{
+    bool any = false;
+    journal_sector_header_t hdr;
+    for (uint32_t i = 0; i < n_sectors; i++)
+    {
+        if (read_header(i, &hdr) && hdr.first_seq + JOURNAL_RECORDS_PER_SECTOR > after_seq + 1 &&
+            (!any || hdr.first_seq < found->first_seq))
+        {
+            *sector = i;
+            *found = hdr;
+            any = true;
+        }
+    }
+    return any;
+}
+
+size_t journal_read(uint32_t after_seq, journal_record_t *out, size_t max)
+{
+    uint32_t sector;
+    journal_sector_header_t hdr;
+    if (!partition || max == 0 || after_seq + 1 >= next_seq() || !find_start(after_seq, &sector, &hdr))
+    {
+        return 0;
+    }
+
+    uint32_t end = next_seq();
+    uint32_t slot = after_seq + 1 > hdr.first_seq ? after_seq + 1 - hdr.first_seq : 0;
+    size_t n = 0;
+    while (n < max)
+    {
+        if (slot >= JOURNAL_RECORDS_PER_SECTOR)
+        {
+            uint32_t expected = hdr.first_seq + JOURNAL_RECORDS_PER_SECTOR;
+            sector = (sector + 1) % n_sectors;
+            if (!read_header(sector, &hdr) || hdr.first_seq != expected)
+            {
+                break;
+            }
+            slot = 0;
+        }
+
+        if (hdr.first_seq + slot >= end)
+        {
+            break;
+        }
+        journal_record_t *rec = &out[n];
+        if (esp_partition_read(partition, slot_offset(sector, slot), rec, sizeof(*rec)) != ESP_OK)
+        {
+            break;
+        }
+        // Torn writes from a brownout and slots left erased by a failed write are skipped, not fatal
+        if (rec->crc == record_crc(rec) && rec->seq == hdr.first_seq + slot)
+        {
+            n++;
+        }
+        slot++;
+    }
+    return n;
+}
+
+uint32_t journal_acked_seq(void)
+{
+    return state.acked_seq;
+}
+
+bool journal_pending(void)
+{
+    // Records lost to failed writes can never be acked, so only a readable one counts
+    journal_record_t rec;
+    return partition && next_seq() > state.acked_seq + 1 && journal_read(state.acked_seq, &rec, 1) > 0;
+}
+
+uint32_t journal_backlog(void)
+{
+    // Readable from RTC memory alone, before journal_init()
+    return state.magic == JOURNAL_STATE_MAGIC ? next_seq() - state.acked_seq - 1 : 0;
+}
+
+void journal_ack(uint32_t seq)
+{
+    if (seq <= state.acked_seq)
+    {
+        return;
+    }
+    state.acked_seq = seq;
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return;
+    }
+    err = nvs_set_u32(nvs_handle, JOURNAL_NVS_ACK_KEY, seq);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving journal ack: %s", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+}
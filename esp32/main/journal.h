@@ -0,0 +1,45 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Must match server.py; crc is CRC32 over the first 28 bytes
+typedef struct __attribute__((packed))
+{
+    uint32_t seq;
+    uint32_t timestamp; // Unix time at acquisition, 0 if the clock was never synced
+    float temperature;
+    float humidity;
+    float pressure;
+    uint32_t gas_resistance;
+    uint16_t iaq_x10;
+    uint8_t iaq_accuracy;
+    uint8_t flags;
+    uint32_t crc;
+} journal_record_t;
+
+/*
+ * Append-only sample log in the "journal" data partition. Sectors are filled
+ * in ring order and the oldest one is erased when the log wraps, so every
+ * sector sees the same number of erase cycles. The write position is kept in
+ * RTC memory and only rebuilt from the sector headers after a cold boot.
+ */
+bool journal_init(void);
+
+// Assigns the record's seq and crc and writes it to flash
+bool journal_append(journal_record_t *rec);
+
+// Copies up to max records with seq > after_seq, oldest first
+size_t journal_read(uint32_t after_seq, journal_record_t *out, size_t max);
+
+// Highest seq the server has confirmed; records above it still need draining
+uint32_t journal_acked_seq(void);
+void journal_ack(uint32_t seq);
+// True while a readable record above the acked seq is left; slots lost to failed writes are skipped
+bool journal_pending(void);
+// Records appended since the last ack, holes included
+uint32_t journal_backlog(void);
+
+#endif
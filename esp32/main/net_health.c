@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include "net_health.h"
+
+static const char *TAG = "net_health";
+
+#define NET_HEALTH_MAGIC 0x4e455431 // "NET1"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t tls_ms;   // connect of the previous upload, TCP and TLS handshake
+    int16_t status;    // HTTP status of the previous upload, 0 if it got no reply
+    uint16_t failures; // failed connections and uploads since the last good upload
+    char fail[32];     // the most recent failure, e.g. "wifi:201", "status:503"
+} health_state_t;
+
+static RTC_DATA_ATTR health_state_t state;
+
+// Current connection attempt
+static int64_t wifi_start_us;
+static int64_t assoc_us;
+static int64_t ip_us;
+static uint16_t retries;
+static int64_t http_start_us;
+
+static void state_init(void)
+{
+    if (state.magic != NET_HEALTH_MAGIC)
+    {
+        memset(&state, 0, sizeof(state));
+        state.magic = NET_HEALTH_MAGIC;
+    }
+}
+
+static uint32_t elapsed_ms(int64_t from, int64_t to)
+{
+    return from && to > from ? (uint32_t)((to - from) / 1000) : 0;
+}
+
+void net_health_wifi_start(void)
+{
+    state_init();
+    wifi_start_us = esp_timer_get_time();
+    assoc_us = 0;
+    ip_us = 0;
+    retries = 0;
+}
+
+void net_health_wifi_associated(void)
+{
+    assoc_us = esp_timer_get_time();
+}
+
+void net_health_wifi_got_ip(void)
+{
+    ip_us = esp_timer_get_time();
+}
+
+void net_health_wifi_disconnected(uint8_t reason)
+{
+    // Our own esp_wifi_stop() before deep sleep
+    if (reason == WIFI_REASON_ASSOC_LEAVE)
+    {
+        return;
+    }
+    state_init();
+    if (ip_us)
+    {
+        // The link dropped after being up; what follows is a new connection
+        net_health_wifi_start();
+    }
+    else
+    {
+        retries++;
+    }
+    snprintf(state.fail, sizeof(state.fail), "wifi:%u", reason);
+}
+
+void net_health_wifi_failed(void)
+{
+    state_init();
+    state.failures++;
+    if (!state.fail[0])
+    {
+        snprintf(state.fail, sizeof(state.fail), "wifi:timeout");
+    }
+}
+
+void net_health_http_start(void)
+{
+    http_start_us = esp_timer_get_time();
+}
+
+void net_health_http_connected(void)
+{
+    // Other requests share the event handler; only the one being timed counts
+    if (http_start_us)
+    {
+        state.tls_ms = elapsed_ms(http_start_us, esp_timer_get_time());
+        http_start_us = 0;
+    }
+}
+
+void net_health_http_done(esp_err_t err, int status)
+{
+    state_init();
+    http_start_us = 0;
+    state.status = err == ESP_OK ? status : 0;
+    if (err == ESP_OK && status >= 200 && status < 300)
+    {
+        // This upload carried the failure and the count to the server
+        state.failures = 0;
+        state.fail[0] = '\0';
+        return;
+    }
+
+    state.failures++;
+    if (err != ESP_OK)
+    {
+        snprintf(state.fail, sizeof(state.fail), "http:%s", esp_err_to_name(err));
+    }
+    else
+    {
+        snprintf(state.fail, sizeof(state.fail), "status:%d", status);
+    }
+    ESP_LOGD(TAG, "Upload failure %u: %s", state.failures, state.fail);
+}
+
+int net_health_format_json(char *buf, size_t len)
+{
+    state_init();
+    wifi_ap_record_t ap;
+    int rssi = 0;
+    unsigned channel = 0;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+    {
+        rssi = ap.rssi;
+        channel = ap.primary;
+    }
+
+    int n = snprintf(buf, len,
+                     "\"net\": {\"rssi\": %d, \"ch\": %u, \"conn_ms\": %lu, \"dhcp_ms\": %lu, \"retries\": %u, "
+                     "\"tls_ms\": %lu, \"status\": %d, \"fails\": %u, \"heap\": %lu, \"heap_min\": %lu, \"reset\": %d",
+                     rssi, channel, elapsed_ms(wifi_start_us, ip_us), elapsed_ms(assoc_us, ip_us), retries,
+                     state.tls_ms, state.status, state.failures, esp_get_free_heap_size(),
+                     esp_get_minimum_free_heap_size(), esp_reset_reason());
+    if (state.fail[0] && n < (int)len)
+    {
+        n += snprintf(buf + n, len - n, ", \"fail\": \"%s\"", state.fail);
+    }
+    if (n < (int)len)
+    {
+        n += snprintf(buf + n, len - n, "}");
+    }
+    return n;
+}
@@ -0,0 +1,35 @@
+#ifndef NET_HEALTH_H
+#define NET_HEALTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Radio and network health, sent with every upload so the server can match
+ * slow or failed wakes to RF conditions. Connect time, DHCP time and retries
+ * describe the current connection. The TLS connect time and HTTP status are
+ * those of the previous upload, because a request's body is built before it
+ * connects. The last failure (disconnect reason, request error or non-2xx
+ * status) and the number of failed attempts since the last good upload are
+ * kept in RTC memory until an upload has carried them to the server.
+ */
+
+// Called from the Wi-Fi and IP event handler
+void net_health_wifi_start(void);
+void net_health_wifi_associated(void);
+void net_health_wifi_got_ip(void);
+void net_health_wifi_disconnected(uint8_t reason);
+
+// This attempt gave up waiting for a connection
+void net_health_wifi_failed(void);
+
+// Around the /sensor request; connected() is called on HTTP_EVENT_ON_CONNECTED
+void net_health_http_start(void);
+void net_health_http_connected(void);
+void net_health_http_done(esp_err_t err, int status);
+
+// Writes "\"net\": {...}" into buf; returns what snprintf would
+int net_health_format_json(char *buf, size_t len);
+
+#endif
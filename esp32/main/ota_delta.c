@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_http_client.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_app_desc.h"
+#include "mbedtls/sha256.h"
+#include "esp_log.h"
+
+#include "ota_delta.h"
+
+static const char *TAG = "ota_delta";
+
+// Must match server/delta_tool.py
+#define DELTA_MAGIC "EDLT"
+#define DELTA_FORMAT_VERSION 1
+#define DELTA_OP_END 0x00
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_INSERT 0x02
+
+#define DELTA_BUF_SIZE 4096
+
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t dst_size;
+    uint32_t reserved;
+    uint8_t src_elf_sha256[32];
+    uint8_t dst_sha256[32];
+} delta_header_t;
+
+typedef struct
+{
+    esp_http_client_handle_t client;
+    const esp_partition_t *running;
+    esp_ota_handle_t ota_handle;
+    mbedtls_sha256_context sha;
+    uint8_t *buf;
+    uint32_t written;
+    uint32_t dst_size;
+} delta_ctx_t;
+
+static bool http_read_exact(esp_http_client_handle_t client, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        int n = esp_http_client_read(client, (char *)buf + got, len - got);
+        if (n <= 0)
+        {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+static bool delta_write(delta_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    if (ctx->written + len > ctx->dst_size)
+    {
+        ESP_LOGE(TAG, "Delta output exceeds target size");
+        return false;
+    }
+
+    esp_err_t err = esp_ota_write(ctx->ota_handle, data, len);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    mbedtls_sha256_update(&ctx->sha, data, len);
+    ctx->written += len;
+    return true;
+}
+
+static bool delta_copy(delta_ctx_t *ctx, uint32_t src_offset, uint32_t len)
+{
+    if (src_offset + len < src_offset || src_offset + len > ctx->running->size)
+    {
+        ESP_LOGE(TAG, "Delta COPY outside running partition");
+        return false;
+    }
+
+    while (len > 0)
+    {
+        uint32_t chunk = len < DELTA_BUF_SIZE ? len : DELTA_BUF_SIZE;
+        esp_err_t err = esp_partition_read(ctx->running, src_offset, ctx->buf, chunk);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to read running partition: %s", esp_err_to_name(err));
+            return false;
+        }
+        if (!delta_write(ctx, ctx->buf, chunk))
+        {
+            return false;
+        }
+        src_offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool delta_insert(delta_ctx_t *ctx, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t chunk = len < DELTA_BUF_SIZE ? len : DELTA_BUF_SIZE;
+        if (!http_read_exact(ctx->client, ctx->buf, chunk))
+        {
+            ESP_LOGE(TAG, "Delta stream ended inside INSERT");
+            return false;
+        }
+        if (!delta_write(ctx, ctx->buf, chunk))
+        {
+            return false;
+        }
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool delta_apply_ops(delta_ctx_t *ctx)
+{
+    while (true)
+    {
+        uint8_t op;
+        uint32_t args[2];
+
+        if (!http_read_exact(ctx->client, &op, 1))
+        {
+            ESP_LOGE(TAG, "Delta stream ended without END op");
+            return false;
+        }
+
+        switch (op)
+        {
+        case DELTA_OP_END:
+            return true;
+        case DELTA_OP_COPY:
+            if (!http_read_exact(ctx->client, args, 8) || !delta_copy(ctx, args[0], args[1]))
+            {
+                return false;
+            }
+            break;
+        case DELTA_OP_INSERT:
+            if (!http_read_exact(ctx->client, args, 4) || !delta_insert(ctx, args[0]))
+            {
+                return false;
+            }
+            break;
+        default:
+            ESP_LOGE(TAG, "Unknown delta op 0x%02x", op);
+            return false;
+        }
+    }
+}
+
+static bool delta_check_header(const delta_header_t *hdr, const esp_partition_t *update)
+{
+    if (memcmp(hdr->magic, DELTA_MAGIC, 4) != 0 || hdr->version != DELTA_FORMAT_VERSION)
+    {
+        ESP_LOGE(TAG, "Invalid delta header");
+        return false;
+    }
+
+    if (memcmp(hdr->src_elf_sha256, esp_app_get_description()->app_elf_sha256, 32) != 0)
+    {
+        ESP_LOGW(TAG, "Delta was built against a different firmware build");
+        return false;
+    }
+
+    if (hdr->dst_size > update->size)
+    {
+        ESP_LOGE(TAG, "Delta target (%lu bytes) does not fit in %s", hdr->dst_size, update->label);
+        return false;
+    }
+    return true;
+}
+
+static bool delta_stream(esp_http_client_handle_t client)
+{
+    delta_header_t hdr;
+    if (!http_read_exact(client, &hdr, sizeof(hdr)))
+    {
+        ESP_LOGE(TAG, "Failed to read delta header");
+        return false;
+    }
+
+    delta_ctx_t ctx = {
+        .client = client,
+        .running = esp_ota_get_running_partition(),
+        .dst_size = hdr.dst_size,
+    };
+    const esp_partition_t *update = esp_ota_get_next_update_partition(NULL);
+    if (!update || !delta_check_header(&hdr, update))
+    {
+        return false;
+    }
+
+    ctx.buf = malloc(DELTA_BUF_SIZE);
+    if (!ctx.buf)
+    {
+        ESP_LOGE(TAG, "Failed to allocate delta buffer");
+        return false;
+    }
+
+    esp_err_t err = esp_ota_begin(update, OTA_WITH_SEQUENTIAL_WRITES, &ctx.ota_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        free(ctx.buf);
+        return false;
+    }
+
+    mbedtls_sha256_init(&ctx.sha);
+    mbedtls_sha256_starts(&ctx.sha, 0);
+
+    bool ok = delta_apply_ops(&ctx);
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&ctx.sha, digest);
+    mbedtls_sha256_free(&ctx.sha);
+    free(ctx.buf);
+
+    if (ok && (ctx.written != hdr.dst_size || memcmp(digest, hdr.dst_sha256, 32) != 0))
+    {
+        ESP_LOGE(TAG, "Patched image does not match target hash");
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        esp_ota_abort(ctx.ota_handle);
+        return false;
+    }
+
+    err = esp_ota_end(ctx.ota_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    err = esp_ota_set_boot_partition(update);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Delta applied: %lu bytes written to %s", ctx.written, update->label);
+    return true;
+}
+
+bool ota_delta_update(const char *url, const char *cert_pem)
+{
+    esp_http_client_config_t config = {
+        .url = url,
+        .timeout_ms = 30000,
+        .cert_pem = cert_pem,
+        .skip_cert_common_name_check = true,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open HTTP client: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return false;
+    }
+
+    bool ok = false;
+    if (esp_http_client_fetch_headers(client) < 0)
+    {
+        ESP_LOGE(TAG, "Failed to fetch headers");
+    }
+    else if (esp_http_client_get_status_code(client) != 200)
+    {
+        ESP_LOGW(TAG, "No delta available (HTTP %d)", esp_http_client_get_status_code(client));
+    }
+    else
+    {
+        ok = delta_stream(client);
+    }
+
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return ok;
+}
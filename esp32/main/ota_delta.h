@@ -0,0 +1,16 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <stdbool.h>
+
+/*
+ * Downloads a delta patch from url and applies it against the running
+ * partition into the next OTA slot, verifying the source ELF hash and the
+ * SHA-256 of the rebuilt image. On success the new slot is set as the boot
+ * partition; the caller is responsible for restarting. Returns false when the
+ * server has no patch for this build or the patch could not be applied, in
+ * which case the caller should fall back to a full-image update.
+ */
+bool ota_delta_update(const char *url, const char *cert_pem);
+
+#endif
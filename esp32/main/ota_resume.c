@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_http_client.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "esp_log.h"
+
+#include "ota_resume.h"
+
+static const char *TAG = "ota_resume";
+
+#define OTA_NVS_NAMESPACE "t_ota"
+#define OTA_NVS_STATE_KEY "state"
+#define OTA_STATE_MAGIC 0x4f544131 // "OTA1"
+
+// Multiple of the flash sector size so every resume starts on a fresh sector
+#define OTA_CHUNK_SIZE (16 * 1024)
+#define OTA_ETAG_LEN 64
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t offset;       // bytes written and checkpointed so far
+    uint32_t total;        // full image size from Content-Range
+    uint32_t crc;          // running CRC32 of bytes [0, offset)
+    uint32_t expected_crc; // CRC32 of the full image announced by the server
+    char etag[OTA_ETAG_LEN];
+} ota_state_t;
+
+typedef struct
+{
+    esp_ota_handle_t handle;
+    uint32_t received;
+    uint32_t crc;
+    uint32_t range_total;
+    uint32_t image_crc;
+    bool has_image_crc;
+    bool write_error;
+    char etag[OTA_ETAG_LEN];
+} ota_chunk_ctx_t;
+
+static bool load_state(ota_state_t *state)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return false;
+    }
+
+    size_t len = sizeof(*state);
+    esp_err_t err = nvs_get_blob(nvs_handle, OTA_NVS_STATE_KEY, state, &len);
+    nvs_close(nvs_handle);
+
+    return err == ESP_OK && len == sizeof(*state) && state->magic == OTA_STATE_MAGIC;
+}
+
+static void save_state(const ota_state_t *state)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_blob(nvs_handle, OTA_NVS_STATE_KEY, state, sizeof(*state));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving OTA checkpoint: %s", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+}
+
+static void clear_state(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+    nvs_erase_key(nvs_handle, OTA_NVS_STATE_KEY);
+    nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+}
+
+bool ota_resume_pending(void)
+{
+    ota_state_t state;
+    return load_state(&state);
+}
+
+static esp_err_t ota_http_event_handler(esp_http_client_event_t *evt)
+{
+    ota_chunk_ctx_t *ctx = (ota_chunk_ctx_t *)evt->user_data;
+
+    switch (evt->event_id)
+    {
+    case HTTP_EVENT_ON_HEADER:
+        if (strcasecmp(evt->header_key, "Content-Range") == 0)
+        {
+            const char *slash = strchr(evt->header_value, '/');
+            if (slash)
+            {
+                ctx->range_total = strtoul(slash + 1, NULL, 10);
+            }
+        }
+        else if (strcasecmp(evt->header_key, "ETag") == 0)
+        {
+            snprintf(ctx->etag, sizeof(ctx->etag), "%s", evt->header_value);
+        }
+        else if (strcasecmp(evt->header_key, "X-Firmware-CRC32") == 0)
+        {
+            ctx->image_crc = strtoul(evt->header_value, NULL, 16);
+            ctx->has_image_crc = true;
+        }
+        break;
+    case HTTP_EVENT_ON_DATA:
+        // Anything but a partial response is not the range we asked for
+        if (ctx->write_error || esp_http_client_get_status_code(evt->client) != 206)
+        {
+            break;
+        }
+        if (esp_ota_write(ctx->handle, evt->data, evt->data_len) != ESP_OK)
+        {
+            ctx->write_error = true;
+            break;
+        }
+        ctx->crc = esp_rom_crc32_le(ctx->crc, evt->data, evt->data_len);
+        ctx->received += evt->data_len;
+        break;
+    default:
+        break;
+    }
+    return ESP_OK;
+}
+
+static ota_resume_result_t ota_finish(esp_ota_handle_t handle, const esp_partition_t *update,
+                                      const ota_state_t *state)
+{
+    clear_state();
+
+    if (state->crc != state->expected_crc)
+    {
+        ESP_LOGE(TAG, "OTA image CRC mismatch: got %08lx, expected %08lx", state->crc, state->expected_crc);
+        esp_ota_abort(handle);
+        return OTA_RESUME_REJECTED;
+    }
+
+    esp_err_t err = esp_ota_end(handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
+        // Image header, SHA-256 or signature check failed; fetching it again will not help
+        return err == ESP_ERR_OTA_VALIDATE_FAILED ? OTA_RESUME_REJECTED : OTA_RESUME_FAILED;
+    }
+
+    err = esp_ota_set_boot_partition(update);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+        return OTA_RESUME_FAILED;
+    }
+    return OTA_RESUME_DONE;
+}
+
+// Returns false when the download has to start over from byte zero
+static bool ota_accept_chunk(ota_state_t *state, const ota_chunk_ctx_t *ctx, uint32_t partition_size)
+{
+    if (state->total == 0)
+    {
+        if (!ctx->has_image_crc || ctx->image_crc != state->expected_crc)
+        {
+            ESP_LOGW(TAG, "Served image is not the announced one");
+            return false;
+        }
+        if (ctx->range_total == 0 || ctx->range_total > partition_size)
+        {
+            ESP_LOGE(TAG, "Server did not describe a usable image (size %lu)", ctx->range_total);
+            return false;
+        }
+        state->total = ctx->range_total;
+        memcpy(state->etag, ctx->etag, sizeof(state->etag));
+    }
+    else if (ctx->range_total != state->total || strcmp(ctx->etag, state->etag) != 0)
+    {
+        ESP_LOGW(TAG, "Firmware image changed on server");
+        return false;
+    }
+    return true;
+}
+
+ota_resume_result_t ota_resume_step(const char *url, const char *cert_pem, uint32_t image_crc,
+                                    uint32_t budget_ms)
+{
+    const esp_partition_t *update = esp_ota_get_next_update_partition(NULL);
+    if (!update)
+    {
+        ESP_LOGE(TAG, "No OTA partition available");
+        return OTA_RESUME_FAILED;
+    }
+
+    ota_state_t state;
+    bool resuming = load_state(&state);
+    if (resuming && state.expected_crc != image_crc)
+    {
+        ESP_LOGW(TAG, "Server now announces a different image, discarding partial download");
+        resuming = false;
+    }
+    if (!resuming)
+    {
+        memset(&state, 0, sizeof(state));
+        state.magic = OTA_STATE_MAGIC;
+        state.expected_crc = image_crc;
+    }
+
+    esp_ota_handle_t handle;
+    esp_err_t err = resuming
+                        ? esp_ota_resume(update, OTA_WITH_SEQUENTIAL_WRITES, state.offset, &handle)
+                        : esp_ota_begin(update, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to %s OTA: %s", resuming ? "resume" : "begin", esp_err_to_name(err));
+        clear_state();
+        return OTA_RESUME_FAILED;
+    }
+
+    if (resuming)
+    {
+        ESP_LOGI(TAG, "Resuming OTA at %lu / %lu bytes", state.offset, state.total);
+    }
+
+    ota_chunk_ctx_t ctx = {
+        .handle = handle,
+    };
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .timeout_ms = 10000,
+        .cert_pem = cert_pem,
+        .skip_cert_common_name_check = true,
+        .event_handler = ota_http_event_handler,
+        .user_data = &ctx,
+        .keep_alive_enable = true,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    int64_t start_us = esp_timer_get_time();
+    ota_resume_result_t result = OTA_RESUME_IN_PROGRESS;
+    bool handle_open = true;
+    char range[40];
+
+    while (true)
+    {
+        uint32_t last = state.offset + OTA_CHUNK_SIZE - 1;
+        if (state.total > 0 && last >= state.total)
+        {
+            last = state.total - 1;
+        }
+
+        snprintf(range, sizeof(range), "bytes=%lu-%lu", state.offset, last);
+        esp_http_client_set_header(client, "Range", range);
+        if (state.etag[0])
+        {
+            esp_http_client_set_header(client, "If-Range", state.etag);
+        }
+
+        ctx.received = 0;
+        ctx.crc = state.crc;
+        ctx.range_total = 0;
+        ctx.has_image_crc = false;
+        ctx.write_error = false;
+        ctx.etag[0] = '\0';
+
+        err = esp_http_client_perform(client);
+        int status_code = esp_http_client_get_status_code(client);
+        if (err != ESP_OK || ctx.write_error)
+        {
+            ESP_LOGE(TAG, "OTA chunk at %lu failed: %s", state.offset,
+                     ctx.write_error ? "flash write error" : esp_err_to_name(err));
+            result = OTA_RESUME_FAILED;
+            break;
+        }
+
+        if (status_code != 206 || !ota_accept_chunk(&state, &ctx, update->size))
+        {
+            ESP_LOGW(TAG, "OTA range request returned HTTP %d, restarting download", status_code);
+            clear_state();
+            result = OTA_RESUME_FAILED;
+            break;
+        }
+
+        if (ctx.received != last - state.offset + 1 && state.offset + ctx.received != state.total)
+        {
+            ESP_LOGW(TAG, "Short OTA chunk: %lu bytes", ctx.received);
+            result = OTA_RESUME_FAILED;
+            break;
+        }
+
+        state.offset += ctx.received;
+        state.crc = ctx.crc;
+        save_state(&state);
+        ESP_LOGD(TAG, "OTA progress: %lu / %lu bytes", state.offset, state.total);
+
+        if (state.offset >= state.total)
+        {
+            handle_open = false;
+            result = ota_finish(handle, update, &state);
+            break;
+        }
+
+        if ((esp_timer_get_time() - start_us) / 1000 >= budget_ms)
+        {
+            ESP_LOGI(TAG, "OTA wake budget used, continuing on next wake");
+            break;
+        }
+    }
+
+    esp_http_client_cleanup(client);
+    if (handle_open)
+    {
+        // Frees the handle only; written sectors stay for the next resume
+        esp_ota_abort(handle);
+    }
+    return result;
+}
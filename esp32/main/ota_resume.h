@@ -0,0 +1,29 @@
+#ifndef OTA_RESUME_H
+#define OTA_RESUME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum
+{
+    OTA_RESUME_DONE,        // image complete and verified, boot partition set
+    OTA_RESUME_IN_PROGRESS, // wake budget used up, continue on a later wake
+    OTA_RESUME_FAILED,      // nothing written this wake, progress kept if still valid
+    OTA_RESUME_REJECTED,    // whole image downloaded but failed verification, progress discarded
+} ota_resume_result_t;
+
+/*
+ * Downloads the next part of the firmware image at url using HTTP Range
+ * requests, writing each chunk into the next OTA slot and checkpointing the
+ * offset, ETag and running CRC32 in NVS after every chunk. image_crc is the
+ * CRC32 the server announced for the image; a partial download of any other
+ * image is discarded. Stops once budget_ms has elapsed so a single wake's
+ * radio-on time stays bounded.
+ */
+ota_resume_result_t ota_resume_step(const char *url, const char *cert_pem, uint32_t image_crc,
+                                    uint32_t budget_ms);
+
+// True when a partially downloaded image is waiting to be continued.
+bool ota_resume_pending(void);
+
+#endif
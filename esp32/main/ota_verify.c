@@ -0,0 +1,166 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "esp_log.h"
+
+#include "ota_verify.h"
+
+static const char *TAG = "ota_verify";
+
+#define OTA_NVS_NAMESPACE "t_ota"
+#define OTA_NVS_TRIAL_KEY "trial"
+#define OTA_TRIAL_MAGIC 0x54524c31 // "TRL1"
+
+#define OTA_VERIFY_TRIAL_ATTEMPTS 12 // an hour at the default sleep
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t partition; // address of the image on trial; any other image is not
+    uint8_t attempts;   // wakes or upload periods started on trial
+    bool active;
+} ota_trial_t;
+
+// RTC copy for deep-sleep wakes; NVS carries it over crashes and power loss
+static RTC_DATA_ATTR ota_trial_t trial;
+
+static void save_trial(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return;
+    }
+
+    err = trial.active ? nvs_set_blob(nvs_handle, OTA_NVS_TRIAL_KEY, &trial, sizeof(trial))
+                       : nvs_erase_key(nvs_handle, OTA_NVS_TRIAL_KEY);
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error saving firmware trial: %s", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+}
+
+static void load_trial(void)
+{
+    memset(&trial, 0, sizeof(trial));
+    nvs_handle_t nvs_handle;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK)
+    {
+        size_t len = sizeof(trial);
+        if (nvs_get_blob(nvs_handle, OTA_NVS_TRIAL_KEY, &trial, &len) != ESP_OK || len != sizeof(trial) ||
+            trial.magic != OTA_TRIAL_MAGIC)
+        {
+            memset(&trial, 0, sizeof(trial));
+        }
+        nvs_close(nvs_handle);
+    }
+    trial.magic = OTA_TRIAL_MAGIC;
+}
+
+static bool running_pending(void)
+{
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+           state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+void ota_verify_init(void)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    // After anything but a deep-sleep wake the RTC copy cannot be trusted
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP || trial.magic != OTA_TRIAL_MAGIC)
+    {
+        load_trial();
+    }
+
+    if (running_pending())
+    {
+        // First boot of a new image
+        memset(&trial, 0, sizeof(trial));
+        trial.magic = OTA_TRIAL_MAGIC;
+        trial.partition = running->address;
+        trial.active = true;
+        ESP_LOGW(TAG, "New firmware on trial for %d attempts", OTA_VERIFY_TRIAL_ATTEMPTS);
+    }
+    else if (trial.active && trial.partition != running->address)
+    {
+        // The bootloader already went back to the previous image
+        ESP_LOGW(TAG, "Image on trial is no longer running, trial dropped");
+        trial.active = false;
+        save_trial();
+        return;
+    }
+
+    if (trial.active)
+    {
+        ota_verify_attempt();
+    }
+}
+
+bool ota_verify_on_trial(void)
+{
+    return trial.magic == OTA_TRIAL_MAGIC && trial.active;
+}
+
+void ota_verify_attempt(void)
+{
+    if (!ota_verify_on_trial())
+    {
+        return;
+    }
+
+    if (trial.attempts >= OTA_VERIFY_TRIAL_ATTEMPTS)
+    {
+        ESP_LOGE(TAG, "New firmware did not reach the server in %u attempts, rolling back", trial.attempts);
+        trial.active = false;
+        save_trial();
+        esp_err_t err = esp_ota_mark_app_invalid_rollback_and_reboot();
+        // Only returns when there is no previous image to go back to
+        ESP_LOGE(TAG, "Rollback not possible (%s), keeping the running image", esp_err_to_name(err));
+        return;
+    }
+
+    trial.attempts++;
+    save_trial();
+    ESP_LOGI(TAG, "Firmware trial attempt %u of %d", trial.attempts, OTA_VERIFY_TRIAL_ATTEMPTS);
+}
+
+void ota_verify_confirm(void)
+{
+    if (!ota_verify_on_trial())
+    {
+        return;
+    }
+
+    if (running_pending())
+    {
+        esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to mark firmware valid: %s", esp_err_to_name(err));
+            return;
+        }
+    }
+    trial.active = false;
+    save_trial();
+    ESP_LOGI(TAG, "New firmware confirmed after %u attempts", trial.attempts);
+}
+
+void ota_verify_hold(void)
+{
+    if (ota_verify_on_trial() && running_pending())
+    {
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+}
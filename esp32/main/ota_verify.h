@@ -0,0 +1,31 @@
+#ifndef OTA_VERIFY_H
+#define OTA_VERIFY_H
+
+#include <stdbool.h>
+
+/*
+ * Trial period of a freshly installed image. The bootloader boots a new image
+ * once in the pending-verify state and rolls it back at the next boot unless
+ * the app has marked it valid. A node that deep-sleeps reboots every wake, so
+ * the trial is counted here instead: the image is kept once it has reached
+ * the server, and rolled back if OTA_VERIFY_TRIAL_ATTEMPTS wakes (or upload
+ * periods in continuous mode) pass without that.
+ */
+
+// Starts or resumes the trial and counts this boot against it; NVS must be up
+void ota_verify_init(void);
+
+// True until the running image has been confirmed
+bool ota_verify_on_trial(void);
+
+// Counts one more attempt; rolls back and reboots once the trial is used up
+void ota_verify_attempt(void);
+
+// The server was reached: keeps the running image and ends the trial
+void ota_verify_confirm(void);
+
+// Before deep sleep: a still pending image is marked valid so the bootloader
+// does not roll it back at the next wake; the trial count takes over from it
+void ota_verify_hold(void);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "phase_prof.h"
+
+static const char *TAG = "phase_prof";
+
+#define PHASE_STATE_MAGIC 0x50524f31 // "PRO1"
+#define PHASE_AVG_SHIFT 3            // moving average over roughly the last 8 runs
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t avg_us[PHASE_COUNT];
+} phase_state_t;
+
+static const char *const phase_name[PHASE_COUNT] = {"nvs", "sensor", "wifi", "upload"};
+
+static RTC_DATA_ATTR phase_state_t state;
+static int64_t start_us[PHASE_COUNT];
+static uint32_t took_us[PHASE_COUNT];
+static bool ran[PHASE_COUNT];
+
+void phase_begin(phase_id_t phase)
+{
+    start_us[phase] = esp_timer_get_time();
+}
+
+void phase_end(phase_id_t phase)
+{
+    if (state.magic != PHASE_STATE_MAGIC)
+    {
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            state.avg_us[i] = 0;
+        }
+        state.magic = PHASE_STATE_MAGIC;
+    }
+
+    took_us[phase] = (uint32_t)(esp_timer_get_time() - start_us[phase]);
+    ran[phase] = true;
+
+    uint32_t avg = state.avg_us[phase];
+    state.avg_us[phase] = avg == 0 ? took_us[phase] : avg - (avg >> PHASE_AVG_SHIFT) + (took_us[phase] >> PHASE_AVG_SHIFT);
+}
+
+void phase_report(const char *plan)
+{
+    uint32_t saved_us = 0;
+
+    ESP_LOGI(TAG, "Wake plan: %s", plan);
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        if (ran[i])
+        {
+            ESP_LOGI(TAG, "  %-7s %6lu ms", phase_name[i], took_us[i] / 1000);
+        }
+        else if (state.magic == PHASE_STATE_MAGIC && state.avg_us[i] > 0)
+        {
+            ESP_LOGI(TAG, "  %-7s skipped, saved ~%lu ms", phase_name[i], state.avg_us[i] / 1000);
+            saved_us += state.avg_us[i];
+        }
+        else
+        {
+            ESP_LOGI(TAG, "  %-7s skipped", phase_name[i]);
+        }
+    }
+    ESP_LOGI(TAG, "  awake   %6lu ms, saved ~%lu ms", (uint32_t)(esp_timer_get_time() / 1000), saved_us / 1000);
+}
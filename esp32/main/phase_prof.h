@@ -0,0 +1,25 @@
+#ifndef PHASE_PROF_H
+#define PHASE_PROF_H
+
+typedef enum
+{
+    PHASE_NVS,
+    PHASE_SENSOR,
+    PHASE_WIFI,
+    PHASE_UPLOAD,
+    PHASE_COUNT,
+} phase_id_t;
+
+/*
+ * Wall-clock profile of one wake. Each phase's duration is folded into a
+ * moving average kept in RTC memory, so a wake that skips a phase can report
+ * roughly what it saved. Phases may overlap (Wi-Fi associates while the
+ * sensor measures).
+ */
+void phase_begin(phase_id_t phase);
+void phase_end(phase_id_t phase);
+
+// Prints every phase of this wake, with the typical cost of the skipped ones
+void phase_report(const char *plan);
+
+#endif
@@ -0,0 +1,139 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sample_stats.h"
+
+#define STATS_VALUE_LIMIT (1 << 26)
+
+static const float channel_scale[STATS_NUM_CHANNELS] = {100.0f, 1000.0f, 1.0f, 1.0f};
+static const char *const channel_name[STATS_NUM_CHANNELS] = {"temperature", "humidity", "pressure", "gas_resistance"};
+
+static int32_t to_fixed(float value, stats_channel_id_t ch)
+{
+    float scaled = value * channel_scale[ch];
+    // Compares rather than fminf/fmaxf, which are library calls on some targets; NaN clamps low
+    scaled = scaled > -STATS_VALUE_LIMIT ? scaled : -STATS_VALUE_LIMIT;
+    scaled = scaled < STATS_VALUE_LIMIT ? scaled : STATS_VALUE_LIMIT;
+    return (int32_t)lrintf(scaled);
+}
+
+void sample_stats_reset(sample_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < STATS_NUM_CHANNELS; i++)
+    {
+        stats->ch[i].min = INT32_MAX;
+        stats->ch[i].max = INT32_MIN;
+    }
+}
+
+static void channel_add(stats_channel_t *c, int32_t x)
+{
+    // |x - shift| <= 2^27, so the square fits comfortably in 64 bits
+    int64_t d = (int64_t)x - c->shift;
+    c->sum += d;
+    c->sum_sq += (uint64_t)(d * d);
+    c->min = x < c->min ? x : c->min;
+    c->max = x > c->max ? x : c->max;
+}
+
+void sample_stats_add(sample_stats_t *stats, const struct bme68x_data *data)
+{
+    int32_t x[STATS_NUM_CHANNELS] = {
+        to_fixed(data->temperature, STATS_TEMPERATURE),
+        to_fixed(data->humidity, STATS_HUMIDITY),
+        to_fixed(data->pressure, STATS_PRESSURE),
+        to_fixed(data->gas_resistance, STATS_GAS),
+    };
+    if (stats->n++ == 0)
+    {
+        for (int i = 0; i < STATS_NUM_CHANNELS; i++)
+        {
+            stats->ch[i].shift = x[i];
+        }
+    }
+    for (int i = 0; i < STATS_NUM_CHANNELS; i++)
+    {
+        channel_add(&stats->ch[i], x[i]);
+    }
+}
+
+void sample_stats_merge(sample_stats_t *dst, const sample_stats_t *src)
+{
+    if (src->n == 0)
+    {
+        return;
+    }
+    if (dst->n == 0)
+    {
+        *dst = *src;
+        return;
+    }
+
+    for (int i = 0; i < STATS_NUM_CHANNELS; i++)
+    {
+        stats_channel_t *a = &dst->ch[i];
+        const stats_channel_t *b = &src->ch[i];
+
+        // Re-centre src's sums on dst's shift, still exactly:
+        // sum((x - sa)^2) = sum((x - sb)^2) + 2 d sum(x - sb) + n d^2 with d = sb - sa.
+        // The middle term may be negative; unsigned wrap-around keeps the total right.
+        int64_t d = (int64_t)b->shift - a->shift;
+        a->sum_sq += b->sum_sq + 2 * (uint64_t)d * (uint64_t)b->sum + (uint64_t)src->n * (uint64_t)(d * d);
+        a->sum += b->sum + (int64_t)src->n * d;
+        a->min = b->min < a->min ? b->min : a->min;
+        a->max = b->max > a->max ? b->max : a->max;
+    }
+    dst->n += src->n;
+}
+
+float sample_stats_min(const sample_stats_t *stats, stats_channel_id_t ch)
+{
+    return stats->ch[ch].min / channel_scale[ch];
+}
+
+float sample_stats_max(const sample_stats_t *stats, stats_channel_id_t ch)
+{
+    return stats->ch[ch].max / channel_scale[ch];
+}
+
+float sample_stats_mean(const sample_stats_t *stats, stats_channel_id_t ch)
+{
+    if (stats->n == 0)
+    {
+        return 0.0f;
+    }
+    const stats_channel_t *c = &stats->ch[ch];
+    return (float)((c->shift + (double)c->sum / stats->n) / channel_scale[ch]);
+}
+
+float sample_stats_variance(const sample_stats_t *stats, stats_channel_id_t ch)
+{
+    if (stats->n < 2)
+    {
+        return 0.0f;
+    }
+    // Software doubles on the ESP32, but this runs once per upload, not per sample
+    const stats_channel_t *c = &stats->ch[ch];
+    double sum = (double)c->sum;
+    double m2 = (double)c->sum_sq - sum * sum / stats->n;
+    double scale = channel_scale[ch];
+    return m2 > 0 ? (float)(m2 / (stats->n - 1) / (scale * scale)) : 0.0f;
+}
+
+int sample_stats_format_json(const sample_stats_t *stats, char *buf, size_t len)
+{
+    int n = snprintf(buf, len, "\"stats\": {\"n\": %lu", (unsigned long)stats->n);
+    for (int i = 0; i < STATS_NUM_CHANNELS && n < (int)len; i++)
+    {
+        n += snprintf(buf + n, len - n, ", \"%s\": [%.2f, %.2f, %.3f, %.3f]", channel_name[i],
+                      sample_stats_min(stats, i), sample_stats_max(stats, i),
+                      sample_stats_mean(stats, i), sqrtf(sample_stats_variance(stats, i)));
+    }
+    if (n < (int)len)
+    {
+        n += snprintf(buf + n, len - n, "}");
+    }
+    return n;
+}
@@ -0,0 +1,57 @@
+#ifndef SAMPLE_STATS_H
+#define SAMPLE_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bme68x.h"
+
+typedef enum
+{
+    STATS_TEMPERATURE, // centi-degC
+    STATS_HUMIDITY,    // milli-%RH
+    STATS_PRESSURE,    // Pa
+    STATS_GAS,         // Ohm
+    STATS_NUM_CHANNELS,
+} stats_channel_id_t;
+
+/*
+ * Streaming statistics in fixed point. Values are scaled to integers per
+ * channel and clamped to +/-2^26. Each channel keeps exact integer sums of
+ * the deviations from its first sample and of their squares, so nothing is
+ * rounded however many samples are added; mean and variance are derived in
+ * double when read. Shifting by the first sample keeps the squared sum small:
+ * it only overflows once the deviations squared add up to 2^64, e.g. after
+ * 2^24 samples a whole megaohm of gas resistance away from the first one.
+ */
+typedef struct
+{
+    int32_t min;
+    int32_t max;
+    int32_t shift;   // first sample; the sums are taken relative to it
+    int64_t sum;     // sum of (x - shift)
+    uint64_t sum_sq; // sum of (x - shift)^2
+} stats_channel_t;
+
+typedef struct
+{
+    uint32_t n;
+    stats_channel_t ch[STATS_NUM_CHANNELS];
+} sample_stats_t;
+
+void sample_stats_reset(sample_stats_t *stats);
+void sample_stats_add(sample_stats_t *stats, const struct bme68x_data *data);
+
+// Folds src into dst as if dst had seen all of src's samples too
+void sample_stats_merge(sample_stats_t *dst, const sample_stats_t *src);
+
+// Channel statistics back in the driver's units (degC, %RH, Pa, Ohm)
+float sample_stats_min(const sample_stats_t *stats, stats_channel_id_t ch);
+float sample_stats_max(const sample_stats_t *stats, stats_channel_id_t ch);
+float sample_stats_mean(const sample_stats_t *stats, stats_channel_id_t ch);
+float sample_stats_variance(const sample_stats_t *stats, stats_channel_id_t ch);
+
+// Writes the uplink form: "stats": {"n": N, "<channel>": [min, max, mean, stddev], ...}
+int sample_stats_format_json(const sample_stats_t *stats, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "spsc_queue.h"
+
+bool spsc_queue_init(spsc_queue_t *q, void *storage, size_t item_size, uint32_t capacity)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        return false;
+    }
+
+    q->buf = (uint8_t *)storage;
+    q->item_size = item_size;
+    q->mask = capacity - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return true;
+}
+
+bool spsc_queue_push(spsc_queue_t *q, const void *item)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head - tail > q->mask)
+    {
+        return false; // full
+    }
+
+    memcpy(q->buf + (head & q->mask) * q->item_size, item, q->item_size);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_queue_pop(spsc_queue_t *q, void *item)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false; // empty
+    }
+
+    memcpy(item, q->buf + (tail & q->mask) * q->item_size, q->item_size);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+uint32_t spsc_queue_count(spsc_queue_t *q)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return head - tail;
+}
@@ -0,0 +1,31 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock-free single-producer/single-consumer ring buffer for passing
+ * fixed-size items between tasks pinned to different cores. Neither side
+ * ever blocks or takes a lock, so the producer's timing is unaffected by
+ * what the consumer is doing. capacity must be a power of two.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    size_t item_size;
+    uint32_t mask;
+    atomic_uint_fast32_t head; // next slot to write, owned by the producer
+    atomic_uint_fast32_t tail; // next slot to read, owned by the consumer
+} spsc_queue_t;
+
+bool spsc_queue_init(spsc_queue_t *q, void *storage, size_t item_size, uint32_t capacity);
+bool spsc_queue_push(spsc_queue_t *q, const void *item);
+bool spsc_queue_pop(spsc_queue_t *q, void *item);
+
+// Exact from the consumer side; the producer may add items concurrently
+uint32_t spsc_queue_count(spsc_queue_t *q);
+
+#endif
@@ -0,0 +1,124 @@
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_netif_sntp.h"
+#include "esp_rtc_time.h"
+#include "esp_log.h"
+
+#include "time_sync.h"
+
+static const char *TAG = "time_sync";
+
+#define TIME_SYNC_SERVER "pool.ntp.org"
+#define TIME_SYNC_TIMEOUT_MS 5000
+#define TIME_SYNC_MAGIC 0x54494d31 // "TIM1"
+
+// Resync sooner while the drift estimate is still unknown
+#define TIME_SYNC_INTERVAL_SEC (6 * 60 * 60)
+#define TIME_SYNC_LEARN_INTERVAL_SEC (60 * 60)
+#define TIME_SYNC_MIN_DRIFT_BASE_SEC 600 // shorter gaps say more about SNTP jitter than drift
+#define TIME_SYNC_MAX_DRIFT_PPM 50000.0f // the internal RC oscillator is within a few percent
+#define TIME_SYNC_DRIFT_ALPHA 0.5f
+
+typedef struct
+{
+    uint32_t magic;
+    int64_t sync_unix_us;  // true time at the last sync
+    uint64_t sync_rtc_us;  // RTC timer at the same moment
+    float drift_ppm;       // how fast the RTC runs; positive means it gains
+    uint8_t drift_samples; // syncs that contributed to drift_ppm
+} time_sync_state_t;
+
+static RTC_DATA_ATTR time_sync_state_t state;
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// An EN or power-on reset restarts the RTC timer, which makes the anchor meaningless
+static bool state_valid(const time_sync_state_t *st, uint64_t rtc_us)
+{
+    return st->magic == TIME_SYNC_MAGIC && rtc_us >= st->sync_rtc_us;
+}
+
+bool time_sync_due(void)
+{
+    uint64_t rtc_us = esp_rtc_get_time_us();
+    if (!state_valid(&state, rtc_us))
+    {
+        return true;
+    }
+    uint64_t interval = state.drift_samples > 0 ? TIME_SYNC_INTERVAL_SEC : TIME_SYNC_LEARN_INTERVAL_SEC;
+    return rtc_us - state.sync_rtc_us >= interval * 1000000ULL;
+}
+
+static void record_sync(int64_t unix_us, uint64_t rtc_us)
+{
+    portENTER_CRITICAL(&state_lock);
+    if (state_valid(&state, rtc_us))
+    {
+        int64_t true_us = unix_us - state.sync_unix_us;
+        int64_t rtc_elapsed_us = (int64_t)(rtc_us - state.sync_rtc_us);
+        if (true_us >= TIME_SYNC_MIN_DRIFT_BASE_SEC * 1000000LL)
+        {
+            float ppm = (float)(rtc_elapsed_us - true_us) * 1e6f / (float)true_us;
+            if (fabsf(ppm) < TIME_SYNC_MAX_DRIFT_PPM)
+            {
+                state.drift_ppm = state.drift_samples == 0
+                                      ? ppm
+                                      : state.drift_ppm + TIME_SYNC_DRIFT_ALPHA * (ppm - state.drift_ppm);
+                if (state.drift_samples < UINT8_MAX)
+                {
+                    state.drift_samples++;
+                }
+            }
+        }
+    }
+    else
+    {
+        state.drift_ppm = 0.0f;
+        state.drift_samples = 0;
+    }
+
+    state.sync_unix_us = unix_us;
+    state.sync_rtc_us = rtc_us;
+    state.magic = TIME_SYNC_MAGIC;
+    portEXIT_CRITICAL(&state_lock);
+}
+
+bool time_sync_now(void)
+{
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(TIME_SYNC_SERVER);
+    esp_netif_sntp_init(&config);
+    esp_err_t err = esp_netif_sntp_sync_wait(pdMS_TO_TICKS(TIME_SYNC_TIMEOUT_MS));
+    esp_netif_sntp_deinit();
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "SNTP sync failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t rtc_us = esp_rtc_get_time_us();
+    uint32_t before = time_sync_unix();
+
+    record_sync((int64_t)tv.tv_sec * 1000000LL + tv.tv_usec, rtc_us);
+    ESP_LOGI(TAG, "Time synced, clock was off by %ld s, RTC drift %.0f ppm", before ? (long)(tv.tv_sec - before) : 0L,
+             state.drift_ppm);
+    return true;
+}
+
+uint32_t time_sync_unix(void)
+{
+    portENTER_CRITICAL(&state_lock);
+    time_sync_state_t st = state;
+    portEXIT_CRITICAL(&state_lock);
+
+    uint64_t rtc_us = esp_rtc_get_time_us();
+    if (!state_valid(&st, rtc_us))
+    {
+        return 0;
+    }
+    double elapsed_us = (double)(rtc_us - st.sync_rtc_us) / (1.0 + st.drift_ppm * 1e-6);
+    return (uint32_t)((st.sync_unix_us + (int64_t)elapsed_us) / 1000000);
+}
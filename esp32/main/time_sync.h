@@ -0,0 +1,23 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Wall-clock time that survives deep sleep without an SNTP round trip on
+ * every wake. Each sync records the true time against the RTC timer; the
+ * RTC's drift is estimated from successive syncs and removed when time is
+ * read back. State lives in RTC memory.
+ */
+
+// True when no sync has happened yet or the drift-corrected clock is due for a check
+bool time_sync_due(void);
+
+// Blocking SNTP sync; needs a network connection
+bool time_sync_now(void);
+
+// Unix time in seconds, or 0 if the clock has never been synced
+uint32_t time_sync_unix(void);
+
+#endif
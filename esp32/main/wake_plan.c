@@ -0,0 +1,97 @@
+#include <math.h>
+#include <string.h>
+#include "esp_attr.h"
+
+#include "wake_plan.h"
+
+#define WAKE_PLAN_MAGIC 0x504c4e31 // "PLN1"
+
+#define WAKE_PLAN_JOURNAL_BATCH 6 // drain skipped samples in one go after this many
+#define WAKE_PLAN_MAX_SKIPPED 12  // still check in for config and firmware at least hourly
+
+#define DEADBAND_TEMPERATURE 0.3f // degC
+#define DEADBAND_HUMIDITY 2.0f    // %RH
+#define DEADBAND_IAQ 15.0f
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t skipped; // wakes since the last upload
+    bool ota_due;
+    float temperature; // last values the server received
+    float humidity;
+    float iaq;
+} wake_plan_state_t;
+
+static RTC_DATA_ATTR wake_plan_state_t state;
+
+void wake_plan_make(const wake_inputs_t *in, wake_plan_t *plan)
+{
+    if (in->cold_boot || state.magic != WAKE_PLAN_MAGIC)
+    {
+        memset(&state, 0, sizeof(state));
+        state.magic = WAKE_PLAN_MAGIC;
+        plan->nvs = true;
+        plan->network = true;
+        plan->reason = "cold boot";
+        return;
+    }
+
+    plan->nvs = in->checkpoint_due || !in->config_cached;
+    plan->network = true;
+    if (in->ota_trial)
+    {
+        // The trial is counted in NVS, and only an upload can end it
+        plan->nvs = true;
+        plan->reason = "new firmware on trial";
+    }
+    else if (state.ota_due)
+    {
+        plan->reason = "firmware update due";
+    }
+    else if (in->journal_backlog >= WAKE_PLAN_JOURNAL_BATCH)
+    {
+        plan->reason = "journal batch full";
+    }
+    else if (state.skipped + 1 >= WAKE_PLAN_MAX_SKIPPED)
+    {
+        plan->reason = "check-in due";
+    }
+    else
+    {
+        plan->network = false;
+        plan->reason = "sensor only unless the reading changes";
+    }
+}
+
+bool wake_plan_reading_changed(wake_plan_t *plan, float temperature, float humidity, float iaq, bool alert)
+{
+    if (alert)
+    {
+        plan->reason = "air quality alert";
+        return true;
+    }
+    if (fabsf(temperature - state.temperature) >= DEADBAND_TEMPERATURE ||
+        fabsf(humidity - state.humidity) >= DEADBAND_HUMIDITY || fabsf(iaq - state.iaq) >= DEADBAND_IAQ)
+    {
+        plan->reason = "reading outside deadband";
+        return true;
+    }
+
+    plan->reason = "sensor only, reading inside deadband";
+    state.skipped++;
+    return false;
+}
+
+void wake_plan_uploaded(float temperature, float humidity, float iaq)
+{
+    state.skipped = 0;
+    state.temperature = temperature;
+    state.humidity = humidity;
+    state.iaq = iaq;
+}
+
+void wake_plan_set_ota_due(bool due)
+{
+    state.ota_due = due;
+}
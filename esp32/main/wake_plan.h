@@ -0,0 +1,40 @@
+#ifndef WAKE_PLAN_H
+#define WAKE_PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+    bool cold_boot;           // anything but a deep-sleep wake; RTC state can't be trusted
+    bool checkpoint_due;      // wake counter wants an NVS commit this wake
+    bool config_cached;       // device config already in RTC memory
+    uint32_t journal_backlog; // samples waiting in the flash journal
+    bool ota_trial;           // running a new image that has not reached the server yet
+} wake_inputs_t;
+
+typedef struct
+{
+    bool nvs;           // needed before the sensor read
+    bool network;       // upload regardless of the reading, so start Wi-Fi alongside the sensor
+    const char *reason; // what decided the network question
+} wake_plan_t;
+
+/*
+ * Decides up front what this wake has to bring up. The network is forced on
+ * a cold boot, while a firmware update is due or a new image is on trial, when the journal holds a full
+ * batch and when the server has not been contacted for too many wakes.
+ * Otherwise it is only started if the reading moved outside the deadband.
+ */
+void wake_plan_make(const wake_inputs_t *in, wake_plan_t *plan);
+
+// Decides a conditional wake once the reading is known; updates plan->reason
+bool wake_plan_reading_changed(wake_plan_t *plan, float temperature, float humidity, float iaq, bool alert);
+
+// Records what the server now holds, which the deadband compares against
+void wake_plan_uploaded(float temperature, float humidity, float iaq);
+
+// Set while the server announces firmware other than the running one
+void wake_plan_set_ota_due(bool due);
+
+#endif
@@ -0,0 +1,101 @@
+// Cost of sample_stats_add next to a double-precision Welford update, on the host.
+// The ESP32 has no double-precision FPU, so there the comparison goes the other way.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sample_stats.h"
+
+#define SAMPLES 4096
+#define ROUNDS 2000
+
+static struct bme68x_data samples[SAMPLES];
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct
+{
+    uint32_t n;
+    double mean[4];
+    double m2[4];
+} welford_t;
+
+static void welford_add(welford_t *w, const struct bme68x_data *d)
+{
+    double x[4] = {d->temperature, d->humidity, d->pressure, d->gas_resistance};
+    w->n++;
+    for (int i = 0; i < 4; i++)
+    {
+        double d1 = x[i] - w->mean[i];
+        w->mean[i] += d1 / w->n;
+        w->m2[i] += d1 * (x[i] - w->mean[i]);
+    }
+}
+
+int main(void)
+{
+    uint32_t r = 2463534242u;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        r ^= r << 13;
+        r ^= r >> 17;
+        r ^= r << 5;
+        samples[i].temperature = 20.0f + (r & 0xffff) / 65536.0f;
+        samples[i].humidity = 45.0f + (r >> 16) / 65536.0f;
+        samples[i].pressure = 101325.0f + (r & 0xff);
+        samples[i].gas_resistance = 120000.0f + (r >> 8 & 0xfff);
+    }
+
+    sample_stats_t stats;
+    sample_stats_reset(&stats);
+    double start = now_s();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            sample_stats_add(&stats, &samples[i]);
+        }
+    }
+    double fixed_s = now_s() - start;
+
+    welford_t w = {0};
+    start = now_s();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            welford_add(&w, &samples[i]);
+        }
+    }
+    double welford_s = now_s() - start;
+
+    // One minute of samples per merge, as after an outage of ROUNDS * 100 minutes
+    sample_stats_t part, merged;
+    sample_stats_reset(&part);
+    sample_stats_reset(&merged);
+    for (int i = 0; i < 60; i++)
+    {
+        sample_stats_add(&part, &samples[i]);
+    }
+    start = now_s();
+    for (int round = 0; round < ROUNDS * 100; round++)
+    {
+        sample_stats_merge(&merged, &part);
+    }
+    double merge_s = now_s() - start;
+
+    double total = (double)SAMPLES * ROUNDS;
+    printf("sample_stats_add:   %6.2f ns/sample\n", fixed_s / total * 1e9);
+    printf("double Welford:     %6.2f ns/sample\n", welford_s / total * 1e9);
+    printf("sample_stats_merge: %6.2f ns/merge\n", merge_s / (ROUNDS * 100) * 1e9);
+    // Keeps the loops from being optimised away
+    printf("(temperature mean %.4f / %.4f / %.4f)\n", sample_stats_mean(&stats, STATS_TEMPERATURE), w.mean[0],
+           sample_stats_mean(&merged, STATS_TEMPERATURE));
+    return 0;
+}
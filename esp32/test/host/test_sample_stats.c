@@ -0,0 +1,259 @@
+// Accuracy of sample_stats against a double-precision reference, on the host
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sample_stats.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                 \
+    do                                                   \
+    {                                                    \
+        if (!(cond))                                     \
+        {                                                \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);  \
+            printf(__VA_ARGS__);                         \
+            printf("\n");                                \
+            failures++;                                  \
+        }                                                \
+    } while (0)
+
+static const char *const channel_name[STATS_NUM_CHANNELS] = {"temperature", "humidity", "pressure", "gas_resistance"};
+// One count of the fixed-point value in the driver's units
+static const double channel_lsb[STATS_NUM_CHANNELS] = {0.01, 0.001, 1.0, 1.0};
+
+static uint32_t rng_state = 2463534242u;
+
+static double uniform(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state / 4294967296.0;
+}
+
+static double value_of(const struct bme68x_data *d, int ch)
+{
+    switch (ch)
+    {
+    case STATS_TEMPERATURE:
+        return d->temperature;
+    case STATS_HUMIDITY:
+        return d->humidity;
+    case STATS_PRESSURE:
+        return d->pressure;
+    default:
+        return d->gas_resistance;
+    }
+}
+
+// Two-pass mean and sample variance in double
+static void reference(const struct bme68x_data *samples, size_t n, double mean[], double stddev[])
+{
+    for (int ch = 0; ch < STATS_NUM_CHANNELS; ch++)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += value_of(&samples[i], ch);
+        }
+        mean[ch] = sum / n;
+        double m2 = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            double d = value_of(&samples[i], ch) - mean[ch];
+            m2 += d * d;
+        }
+        stddev[ch] = n > 1 ? sqrt(m2 / (n - 1)) : 0;
+    }
+}
+
+// An indoor node at 1 Hz: slow drifts, sensor noise, a gas sensor that wanders
+static void generate(struct bme68x_data *samples, size_t n)
+{
+    double gas = 120000;
+    for (size_t i = 0; i < n; i++)
+    {
+        double t = (double)i / 3600;
+        gas += (uniform() - 0.5) * 2000;
+        gas = fmin(fmax(gas, 20000), 400000);
+        samples[i].temperature = (float)(20.0 + uniform());
+        samples[i].humidity = (float)(45.0 + 5.0 * sin(t * 6.283) + (uniform() - 0.5));
+        samples[i].pressure = (float)(101325.0 + 100.0 * uniform());
+        samples[i].gas_resistance = (float)gas;
+    }
+}
+
+static void check_against_reference(const char *what, const sample_stats_t *stats,
+                                     const struct bme68x_data *samples, size_t n)
+{
+    double mean[STATS_NUM_CHANNELS], stddev[STATS_NUM_CHANNELS];
+    reference(samples, n, mean, stddev);
+    CHECK(stats->n == n, "%s: n %lu, expected %zu", what, (unsigned long)stats->n, n);
+    for (int ch = 0; ch < STATS_NUM_CHANNELS; ch++)
+    {
+        // Rounding each sample to the fixed-point scale moves the mean by at most
+        // half a count and the stddev by well under one; the float result adds its ulp
+        double got_mean = sample_stats_mean(stats, ch);
+        double got_stddev = sqrt(sample_stats_variance(stats, ch));
+        double tol = 0.5 * channel_lsb[ch] + fabs(mean[ch]) * FLT_EPSILON;
+        CHECK(fabs(got_mean - mean[ch]) <= tol, "%s %s: mean %.6f, reference %.6f",
+              what, channel_name[ch], got_mean, mean[ch]);
+        CHECK(fabs(got_stddev - stddev[ch]) <= 0.5 * channel_lsb[ch] + stddev[ch] * 1e-5,
+              "%s %s: stddev %.6f, reference %.6f", what, channel_name[ch], got_stddev, stddev[ch]);
+    }
+}
+
+#define MAX_SAMPLES 86400
+static struct bme68x_data samples[MAX_SAMPLES];
+
+static void test_accuracy(void)
+{
+    static const size_t lengths[] = {2, 10, 300, 3600, 18000, 86400};
+    generate(samples, MAX_SAMPLES);
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        sample_stats_t stats;
+        sample_stats_reset(&stats);
+        for (size_t j = 0; j < lengths[i]; j++)
+        {
+            sample_stats_add(&stats, &samples[j]);
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "N=%zu", lengths[i]);
+        check_against_reference(what, &stats, samples, lengths[i]);
+    }
+}
+
+static void test_min_max(void)
+{
+    sample_stats_t stats;
+    sample_stats_reset(&stats);
+    for (size_t i = 0; i < 3600; i++)
+    {
+        sample_stats_add(&stats, &samples[i]);
+    }
+    for (int ch = 0; ch < STATS_NUM_CHANNELS; ch++)
+    {
+        double lo = INFINITY, hi = -INFINITY;
+        for (size_t i = 0; i < 3600; i++)
+        {
+            lo = fmin(lo, value_of(&samples[i], ch));
+            hi = fmax(hi, value_of(&samples[i], ch));
+        }
+        CHECK(fabs(sample_stats_min(&stats, ch) - lo) <= 0.5 * channel_lsb[ch] + fabs(lo) * FLT_EPSILON,
+              "%s: min %.4f, reference %.4f", channel_name[ch], sample_stats_min(&stats, ch), lo);
+        CHECK(fabs(sample_stats_max(&stats, ch) - hi) <= 0.5 * channel_lsb[ch] + fabs(hi) * FLT_EPSILON,
+              "%s: max %.4f, reference %.4f", channel_name[ch], sample_stats_max(&stats, ch), hi);
+    }
+}
+
+static void test_constant(void)
+{
+    // A steady value must give exactly that mean and no spread, however long
+    struct bme68x_data d = {.temperature = 21.37f, .humidity = 40.125f, .pressure = 99870.0f, .gas_resistance = 153211.0f};
+    sample_stats_t stats;
+    sample_stats_reset(&stats);
+    for (int i = 0; i < 100000; i++)
+    {
+        sample_stats_add(&stats, &d);
+    }
+    CHECK(fabsf(sample_stats_mean(&stats, STATS_TEMPERATURE) - 21.37f) < 1e-5f, "constant temperature mean %.6f",
+          sample_stats_mean(&stats, STATS_TEMPERATURE));
+    CHECK(sample_stats_mean(&stats, STATS_PRESSURE) == 99870.0f, "constant pressure mean %.3f",
+          sample_stats_mean(&stats, STATS_PRESSURE));
+    for (int ch = 0; ch < STATS_NUM_CHANNELS; ch++)
+    {
+        CHECK(sample_stats_variance(&stats, ch) == 0.0f, "constant %s variance %g", channel_name[ch],
+              sample_stats_variance(&stats, ch));
+    }
+}
+
+static void test_small_n(void)
+{
+    sample_stats_t stats;
+    sample_stats_reset(&stats);
+    CHECK(sample_stats_mean(&stats, STATS_TEMPERATURE) == 0.0f, "empty mean");
+    CHECK(sample_stats_variance(&stats, STATS_TEMPERATURE) == 0.0f, "empty variance");
+    sample_stats_add(&stats, &samples[0]);
+    CHECK(fabs(sample_stats_mean(&stats, STATS_HUMIDITY) - samples[0].humidity) <= 0.0005, "single sample mean");
+    CHECK(sample_stats_variance(&stats, STATS_HUMIDITY) == 0.0f, "single sample variance");
+}
+
+static void test_merge(void)
+{
+    // Merging the intervals of a long outage must give what one accumulator
+    // over all samples gives, bit for bit, whatever the interval lengths
+    static const size_t cuts[] = {0, 1, 61, 600, 3600, 3601, 20000, 86400};
+    sample_stats_t whole, merged;
+    sample_stats_reset(&whole);
+    sample_stats_reset(&merged);
+    for (size_t i = 0; i < MAX_SAMPLES; i++)
+    {
+        sample_stats_add(&whole, &samples[i]);
+    }
+    for (size_t k = 0; k + 1 < sizeof(cuts) / sizeof(cuts[0]); k++)
+    {
+        sample_stats_t part;
+        sample_stats_reset(&part);
+        for (size_t i = cuts[k]; i < cuts[k + 1]; i++)
+        {
+            sample_stats_add(&part, &samples[i]);
+        }
+        sample_stats_merge(&merged, &part);
+    }
+    CHECK(merged.n == whole.n, "merged n %lu, expected %lu", (unsigned long)merged.n, (unsigned long)whole.n);
+    for (int ch = 0; ch < STATS_NUM_CHANNELS; ch++)
+    {
+        CHECK(sample_stats_mean(&merged, ch) == sample_stats_mean(&whole, ch), "merged %s mean %.6f, whole %.6f",
+              channel_name[ch], sample_stats_mean(&merged, ch), sample_stats_mean(&whole, ch));
+        CHECK(sample_stats_variance(&merged, ch) == sample_stats_variance(&whole, ch),
+              "merged %s variance %g, whole %g", channel_name[ch], sample_stats_variance(&merged, ch),
+              sample_stats_variance(&whole, ch));
+        CHECK(merged.ch[ch].min == whole.ch[ch].min && merged.ch[ch].max == whole.ch[ch].max,
+              "merged %s min/max", channel_name[ch]);
+    }
+    check_against_reference("merged", &merged, samples, MAX_SAMPLES);
+}
+
+static void test_format_json(void)
+{
+    struct bme68x_data a = {.temperature = 20.0f, .humidity = 40.0f, .pressure = 101300.0f, .gas_resistance = 100000.0f};
+    struct bme68x_data b = {.temperature = 22.0f, .humidity = 42.0f, .pressure = 101302.0f, .gas_resistance = 100002.0f};
+    sample_stats_t stats;
+    sample_stats_reset(&stats);
+    sample_stats_add(&stats, &a);
+    sample_stats_add(&stats, &b);
+    char buf[512];
+    int n = sample_stats_format_json(&stats, buf, sizeof(buf));
+    CHECK(n == (int)strlen(buf), "format length %d, wrote %zu", n, strlen(buf));
+    CHECK(strcmp(buf, "\"stats\": {\"n\": 2, \"temperature\": [20.00, 22.00, 21.000, 1.414], "
+                      "\"humidity\": [40.00, 42.00, 41.000, 1.414], "
+                      "\"pressure\": [101300.00, 101302.00, 101301.000, 1.414], "
+                      "\"gas_resistance\": [100000.00, 100002.00, 100001.000, 1.414]}") == 0,
+          "format: %s", buf);
+
+    // Truncated output still reports the length it needed
+    char small[16];
+    CHECK(sample_stats_format_json(&stats, small, sizeof(small)) >= (int)sizeof(small), "truncated format length");
+}
+
+int main(void)
+{
+    test_accuracy();
+    test_min_max();
+    test_constant();
+    test_small_n();
+    test_merge();
+    test_format_json();
+    if (failures)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("sample_stats: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+import argparse
+import os
+import re
+import shlex
+import statistics
+import subprocess
+import sys
+import time
+
+import serial
+
+# Measures how long each build profile takes from reset to app_main.
+#
+# Every profile in profiles/ is rebuilt with sdkconfig.boottime appended,
+# flashed, and then reset over the serial port's RTS line (EN) a number of
+# times. The firmware prints "boot_time: reset <us>" from the RTC timer,
+# which restarts with EN; the host's own RTS-to-marker time is shown next to
+# it as a cross-check. With --wakes the tool also waits for that many
+# deep-sleep wakes and collects "boot_time: wake <us>", which is the figure
+# paid on every 5-minute cycle.
+
+PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BOOTTIME_FRAGMENT = 'tools/sdkconfig.boottime'
+MARKER_RE = re.compile(rb'boot_time: (reset|wake) (\d+) us')
+
+
+def profile_args(name):
+    with open(os.path.join(PROJECT_DIR, 'profiles', name)) as f:
+        args = shlex.split(f.read())
+
+    # Measure a separate build so the profile's own build dir stays untouched
+    out = []
+    for arg in args:
+        if arg.startswith('-DSDKCONFIG_DEFAULTS='):
+            arg = f'{arg};{BOOTTIME_FRAGMENT}'
+        elif arg.startswith('-DSDKCONFIG='):
+            arg = f'-DSDKCONFIG=build_boot_{name}/sdkconfig'
+        out.append(arg)
+    if out and out[0] == '-B':
+        out[1] = f'build_boot_{name}'
+    return out
+
+
+def flash(name, port):
+    cmd = ['idf.py'] + profile_args(name) + ['-p', port, 'flash']
+    print(' '.join(cmd))
+    subprocess.run(cmd, cwd=PROJECT_DIR, check=True)
+
+
+def read_marker(ser, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        m = MARKER_RE.search(ser.readline())
+        if m:
+            return m.group(1).decode(), int(m.group(2)), time.monotonic()
+    return None
+
+
+def measure_resets(ser, count, timeout):
+    device_ms, host_ms = [], []
+    for _ in range(count):
+        # DTR high would pull GPIO0 low and enter the ROM downloader
+        ser.dtr = False
+        ser.rts = True
+        time.sleep(0.1)
+        ser.reset_input_buffer()
+        ser.rts = False
+        t0 = time.monotonic()
+
+        marker = read_marker(ser, timeout)
+        if not marker or marker[0] != 'reset':
+            print('  no reset marker, is the board wired for auto-reset?', file=sys.stderr)
+            continue
+        device_ms.append(marker[1] / 1000)
+        host_ms.append((marker[2] - t0) * 1000)
+        # Let the wake run to deep sleep so the next reset starts from the same state
+        time.sleep(timeout / 4)
+    return device_ms, host_ms
+
+
+def measure_wakes(ser, count, timeout):
+    wake_ms = []
+    while len(wake_ms) < count:
+        marker = read_marker(ser, timeout)
+        if not marker:
+            print('  timed out waiting for a deep-sleep wake', file=sys.stderr)
+            break
+        if marker[0] == 'wake':
+            wake_ms.append(marker[1] / 1000)
+    return wake_ms
+
+
+def summary(values):
+    if not values:
+        return 'n/a'
+    return (f'{min(values):7.1f} {statistics.median(values):7.1f} {max(values):7.1f}'
+            f'  (n={len(values)})')
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Measure reset-to-app_main time per build profile')
+    parser.add_argument('--port', required=True, help='serial port of the node')
+    parser.add_argument('--profiles', nargs='+', default=['dev', 'fleet'])
+    parser.add_argument('--resets', type=int, default=10, help='EN resets per profile')
+    parser.add_argument('--wakes', type=int, default=0,
+                        help='deep-sleep wakes to wait for per profile (slow: one per sleep period)')
+    parser.add_argument('--timeout', type=float, default=20.0, help='seconds to wait for a marker')
+    parser.add_argument('--no-flash', action='store_true', help='measure whatever is on the board')
+    args = parser.parse_args(argv)
+
+    results = {}
+    for name in args.profiles:
+        print(f'== {name}')
+        if not args.no_flash:
+            flash(name, args.port)
+        with serial.Serial(args.port, 115200, timeout=0.5) as ser:
+            device_ms, host_ms = measure_resets(ser, args.resets, args.timeout)
+            wake_ms = measure_wakes(ser, args.wakes, args.timeout + 3600) if args.wakes else []
+        results[name] = (device_ms, host_ms, wake_ms)
+
+    print()
+    print(f'{"profile":10} {"":22} {"min":>7} {"median":>7} {"max":>7}  ms')
+    for name, (device_ms, host_ms, wake_ms) in results.items():
+        print(f'{name:10} {"reset (device RTC)":22} {summary(device_ms)}')
+        print(f'{"":10} {"reset (host serial)":22} {summary(host_ms)}')
+        if args.wakes:
+            print(f'{"":10} {"deep-sleep wake":22} {summary(wake_ms)}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,336 @@
+import argparse
+import json
+import math
+import os
+import struct
+import sys
+import zlib
+from datetime import datetime, timezone
+
+import storage
+
+# Columnar archive of raw sensor_data, one file per closed UTC day.
+#
+# Layout:
+#   b'SCA1' | u32 directory length | directory (JSON) | column blobs
+#
+# The directory lists, per device, the row count and for each column its
+# offset (from the end of the directory), length and CRC32, so a reader
+# seeks straight to one channel without touching the others. Timestamps are
+# delta-of-delta encoded and channels use Gorilla XOR compression on float64,
+# both as in Pelkonen et al., "Gorilla: A Fast, Scalable, In-Memory Time
+# Series Database" (VLDB 2015).
+
+MAGIC = b'SCA1'
+DAY = 86400
+# Journal backfill can arrive days late; a day is archived once it is this old
+# and rows that show up for it afterwards are merged into its file
+ARCHIVE_AFTER = 7 * DAY
+
+
+class ArchiveError(Exception):
+    pass
+
+
+class BitWriter:
+    def __init__(self):
+        self._buf = bytearray()
+        self._acc = 0
+        self._bits = 0
+
+    def write(self, value, bits):
+        self._acc = (self._acc << bits) | (value & ((1 << bits) - 1))
+        self._bits += bits
+        while self._bits >= 8:
+            self._bits -= 8
+            self._buf.append((self._acc >> self._bits) & 0xFF)
+        self._acc &= (1 << self._bits) - 1
+
+    def getvalue(self):
+        if self._bits:
+            return bytes(self._buf) + bytes([(self._acc << (8 - self._bits)) & 0xFF])
+        return bytes(self._buf)
+
+
+class BitReader:
+    def __init__(self, data):
+        self._data = data
+        self._pos = 0
+
+    def read(self, bits):
+        start = self._pos >> 3
+        end = (self._pos + bits + 7) >> 3
+        if end > len(self._data):
+            raise ArchiveError('column truncated')
+        chunk = int.from_bytes(self._data[start:end], 'big')
+        shift = (end - start) * 8 - (self._pos & 7) - bits
+        self._pos += bits
+        return (chunk >> shift) & ((1 << bits) - 1)
+
+
+def _zigzag(n):
+    return (n << 1) ^ (n >> 63)
+
+
+def _unzigzag(n):
+    return (n >> 1) ^ -(n & 1)
+
+
+# (prefix, prefix bits, payload bits) for zigzagged delta-of-delta values
+_DOD_CLASSES = ((0b10, 2, 7), (0b110, 3, 9), (0b1110, 4, 12), (0b1111, 4, 64))
+
+
+def encode_timestamps(values):
+    w = BitWriter()
+    prev = prev_delta = 0
+    for i, ts in enumerate(values):
+        if i == 0:
+            w.write(ts, 64)
+        else:
+            delta = ts - prev
+            dod = _zigzag(delta - prev_delta)
+            if dod == 0:
+                w.write(0, 1)
+            else:
+                for prefix, prefix_bits, bits in _DOD_CLASSES:
+                    if dod < (1 << bits):
+                        w.write(prefix, prefix_bits)
+                        w.write(dod, bits)
+                        break
+            prev_delta = delta
+        prev = ts
+    return w.getvalue()
+
+
+def decode_timestamps(data, count):
+    r = BitReader(data)
+    out = []
+    prev = prev_delta = 0
+    for i in range(count):
+        if i == 0:
+            ts = r.read(64)
+        else:
+            if r.read(1) == 0:
+                dod = 0
+            elif r.read(1) == 0:
+                dod = _unzigzag(r.read(7))
+            elif r.read(1) == 0:
+                dod = _unzigzag(r.read(9))
+            elif r.read(1) == 0:
+                dod = _unzigzag(r.read(12))
+            else:
+                dod = _unzigzag(r.read(64))
+            prev_delta += dod
+            ts = prev + prev_delta
+        out.append(ts)
+        prev = ts
+    return out
+
+
+def _float_bits(value):
+    return struct.unpack('<Q', struct.pack('<d', math.nan if value is None else value))[0]
+
+
+def encode_floats(values):
+    w = BitWriter()
+    prev = 0
+    leading = trailing = -1
+    for i, value in enumerate(values):
+        bits = _float_bits(value)
+        if i == 0:
+            w.write(bits, 64)
+        else:
+            xor = bits ^ prev
+            if xor == 0:
+                w.write(0, 1)
+            else:
+                lz = min(64 - xor.bit_length(), 31)
+                tz = (xor & -xor).bit_length() - 1
+                if leading >= 0 and lz >= leading and tz >= trailing:
+                    # Meaningful bits fit in the previous window
+                    w.write(0b10, 2)
+                    w.write(xor >> trailing, 64 - leading - trailing)
+                else:
+                    leading, trailing = lz, tz
+                    meaningful = 64 - lz - tz
+                    w.write(0b11, 2)
+                    w.write(lz, 5)
+                    w.write(meaningful & 63, 6)  # 64 does not fit; stored as 0
+                    w.write(xor >> tz, meaningful)
+        prev = bits
+    return w.getvalue()
+
+
+def decode_floats(data, count):
+    r = BitReader(data)
+    out = []
+    prev = 0
+    leading = trailing = 0
+    for i in range(count):
+        if i == 0:
+            bits = r.read(64)
+        elif r.read(1) == 0:
+            bits = prev
+        else:
+            if r.read(1) == 1:
+                leading = r.read(5)
+                meaningful = r.read(6) or 64
+                trailing = 64 - leading - meaningful
+            bits = prev ^ (r.read(64 - leading - trailing) << trailing)
+        out.append(struct.unpack('<d', struct.pack('<Q', bits))[0])
+        prev = bits
+    return out
+
+
+def write_partition(path, series):
+    """Writes {device: [(ts, temperature, humidity, pressure, gas_resistance), ...]} to path."""
+    blobs = []
+    offset = 0
+    directory = {'version': 1, 'devices': {}}
+    for device, rows in sorted(series.items()):
+        rows = sorted(rows)
+        columns = {'ts': encode_timestamps([row[0] for row in rows])}
+        for i, channel in enumerate(storage.CHANNELS):
+            columns[channel] = encode_floats([row[1 + i] for row in rows])
+
+        entry = {'rows': len(rows), 'first_ts': rows[0][0], 'last_ts': rows[-1][0], 'columns': {}}
+        for name, blob in columns.items():
+            entry['columns'][name] = [offset, len(blob), zlib.crc32(blob)]
+            blobs.append(blob)
+            offset += len(blob)
+        directory['devices'][device] = entry
+
+    header = json.dumps(directory, separators=(',', ':')).encode()
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(MAGIC + struct.pack('<I', len(header)) + header)
+        for blob in blobs:
+            f.write(blob)
+    os.replace(tmp, path)
+    return 8 + len(header) + offset
+
+
+class ArchiveReader:
+    """Reads one partition; only the directory is loaded up front."""
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            if f.read(4) != MAGIC:
+                raise ArchiveError(f'{path}: not a sensor archive')
+            (length,) = struct.unpack('<I', f.read(4))
+            self._directory = json.loads(f.read(length))
+        self._data_start = 8 + length
+
+    def devices(self):
+        return {device: {k: v for k, v in entry.items() if k != 'columns'}
+                for device, entry in self._directory['devices'].items()}
+
+    def read_column(self, device, name):
+        try:
+            entry = self._directory['devices'][device]
+            offset, length, crc = entry['columns'][name]
+        except KeyError:
+            raise ArchiveError(f'{self.path}: no column {name!r} for device {device!r}')
+        with open(self.path, 'rb') as f:
+            f.seek(self._data_start + offset)
+            blob = f.read(length)
+        if zlib.crc32(blob) != crc:
+            raise ArchiveError(f'{self.path}: column {name!r} of {device!r} is corrupt')
+        if name == 'ts':
+            return decode_timestamps(blob, entry['rows'])
+        return decode_floats(blob, entry['rows'])
+
+    def scan(self, device, channel):
+        """(ts, value) pairs of one channel; decodes just the two columns involved."""
+        return list(zip(self.read_column(device, 'ts'), self.read_column(device, channel)))
+
+    def series(self):
+        """Every row, in the form write_partition() takes."""
+        return {device: list(zip(*(self.read_column(device, name) for name in ('ts',) + storage.CHANNELS)))
+                for device in self.devices()}
+
+
+def partition_path(archive_dir, day):
+    return os.path.join(archive_dir, f'{datetime.fromtimestamp(day, timezone.utc):%Y-%m-%d}.sca')
+
+
+def _row_key(device, row):
+    # NaN != NaN, and NULL channels come back from a partition as NaN
+    return (device, row[0]) + tuple(_float_bits(value) for value in row[1:])
+
+
+def archive_closed(conn, archive_dir, now):
+    """Archives every day older than ARCHIVE_AFTER that has raw rows not yet in its file.
+
+    ids only grow, so the rows of a day above the max_id recorded for it are
+    new; they are merged with what the file already holds, whose raw copies
+    retention may have deleted. Runs in the ingest writer thread before
+    retention pruning, so a row is always on disk before it is deleted.
+    """
+    first = conn.execute('SELECT MIN(ts) FROM sensor_data').fetchone()[0]
+    if first is None:
+        return 0
+    os.makedirs(archive_dir, exist_ok=True)
+
+    written = 0
+    day = first // DAY * DAY
+    while day + DAY <= now - ARCHIVE_AFTER:
+        archived = conn.execute('SELECT max_id FROM archive WHERE day = ?', (day,)).fetchone()
+        since = archived[0] if archived else 0
+        new = conn.execute(f'SELECT id, device, ts, {", ".join(storage.CHANNELS)} FROM sensor_data '
+                           'WHERE ts >= ? AND ts < ? AND id > ?', (day, day + DAY, since)).fetchall()
+        if not new:
+            day += DAY
+            continue
+
+        path = partition_path(archive_dir, day)
+        series = {}
+        if archived:
+            try:
+                series = ArchiveReader(path).series()
+            except (OSError, ArchiveError) as e:
+                print(f"Archive {path} unreadable, rewriting it from the raw rows left: {e}")
+        # Archived before ids were recorded: the raw rows still kept may be in the file already
+        seen = {_row_key(device, row) for device, rows in series.items() for row in rows} \
+            if archived and not since else set()
+        for _, device, ts, *values in new:
+            row = (ts, *values)
+            if _row_key(device, row) not in seen:
+                series.setdefault(device, []).append(row)
+
+        size = write_partition(path, series)
+        with conn:
+            conn.execute('INSERT OR REPLACE INTO archive (day, rows, bytes, max_id) VALUES (?, ?, ?, ?)',
+                         (day, sum(len(rows) for rows in series.values()), size, max(row[0] for row in new)))
+        written += 1
+        day += DAY
+    return written
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Inspect a sensor archive partition')
+    parser.add_argument('file')
+    parser.add_argument('--device', help='device to dump')
+    parser.add_argument('--channel', default='temperature', help='channel to dump with --device')
+    args = parser.parse_args(argv)
+
+    reader = ArchiveReader(args.file)
+    if args.device is None:
+        size = os.path.getsize(args.file)
+        rows = sum(entry['rows'] for entry in reader.devices().values())
+        # Compared with 8 bytes per timestamp and per channel value
+        raw = rows * 8 * (1 + len(storage.CHANNELS))
+        print(f'{args.file}: {rows} rows, {size} bytes ({raw / size:.1f}x smaller than uncompressed)'
+              if size else f'{args.file}: empty')
+        for device, entry in sorted(reader.devices().items()):
+            print(f'  {device or "-":16} {entry["rows"]:7} rows  {entry["first_ts"]} .. {entry["last_ts"]}')
+        return 0
+
+    for ts, value in reader.scan(args.device, args.channel):
+        print(f'{ts},{value}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,138 @@
+import collections
+import heapq
+import threading
+
+import storage
+
+
+class ReadingCache:
+    """Newest reading and a window of recent readings per device, in memory.
+
+    Readings are dicts with at least 'device' and 'ts'. Every accepted upload
+    goes through add(), so /latest and /recent are answered without touching
+    SQLite; only a /recent asking for more than the window falls back to it.
+    Journal backfill can arrive after fresher live readings, so rings are
+    kept in time order and the latest entry only moves forward. A reading
+    with the same device and time as one already held is a duplicate (the
+    same sample seen through TableFollower) and is dropped.
+    """
+
+    def __init__(self, window=720):
+        self.window = window
+        self._lock = threading.Lock()
+        self._latest = {}
+        self._recent = {}
+        self._hits = 0
+        self._misses = 0
+
+    def add(self, reading):
+        device = reading['device']
+        with self._lock:
+            current = self._latest.get(device)
+            if current is None or reading['ts'] > current['ts']:
+                self._latest[device] = reading
+
+            ring = self._recent.get(device)
+            if ring is None:
+                ring = self._recent[device] = collections.deque(maxlen=self.window)
+            if not ring or reading['ts'] > ring[-1]['ts']:
+                ring.append(reading)
+            elif len(ring) < ring.maxlen or reading['ts'] > ring[0]['ts']:
+                i = len(ring)
+                while i > 0 and ring[i - 1]['ts'] > reading['ts']:
+                    i -= 1
+                if i > 0 and ring[i - 1]['ts'] == reading['ts']:
+                    return
+                if len(ring) == ring.maxlen:
+                    ring.popleft()
+                    i -= 1
+                ring.insert(i, reading)
+
+    def warm(self, rows):
+        """Seeds the cache from stored rows, oldest first."""
+        for row in rows:
+            row = dict(row)
+            row.pop('id', None)
+            self.add(row)
+
+    def _count(self, hit):
+        if hit:
+            self._hits += 1
+        else:
+            self._misses += 1
+
+    def get(self, device):
+        with self._lock:
+            reading = self._latest.get(device)
+            self._count(reading is not None)
+            return reading
+
+    def newest(self):
+        with self._lock:
+            reading = max(self._latest.values(), key=lambda r: r['ts'], default=None)
+            self._count(reading is not None)
+            return reading
+
+    def recent(self, n, device=None):
+        """Up to n newest readings, oldest first, or None if the window cannot answer."""
+        with self._lock:
+            # A ring holds either all of a device's readings or its newest `window`
+            # of them, so any n up to the window is answered exactly
+            if device is None:
+                complete = n <= self.window
+                readings = heapq.nlargest(n, (r for ring in self._recent.values() for r in ring),
+                                          key=lambda r: r['ts'])
+                readings.reverse()
+            else:
+                ring = self._recent.get(device)
+                complete = ring is not None and n <= self.window
+                readings = list(ring)[-n:] if ring else []
+            self._count(complete)
+            return readings if complete else None
+
+    def devices(self):
+        with self._lock:
+            return dict(self._latest)
+
+    def stats(self):
+        with self._lock:
+            return {
+                'hits': self._hits,
+                'misses': self._misses,
+                'devices': len(self._latest),
+                'readings': sum(len(ring) for ring in self._recent.values()),
+                'window': self.window,
+            }
+
+
+class TableFollower(threading.Thread):
+    """Feeds a ReadingCache with rows stored by other worker processes.
+
+    Each worker has its own cache and ingest writer, so without this /latest
+    would only know about uploads that reached the same worker. Polls
+    sensor_data by row id, which is cheap on the primary key.
+    """
+
+    def __init__(self, cache, pool, last_id, interval=1.0):
+        super().__init__(name='cache-follower', daemon=True)
+        self.cache = cache
+        self.pool = pool
+        self.last_id = last_id
+        self.interval = interval
+        self._stop_event = threading.Event()
+
+    def run(self):
+        while not self._stop_event.wait(self.interval):
+            try:
+                with self.pool.connection() as conn:
+                    rows = storage.rows_after(conn, self.last_id)
+            except Exception as e:
+                print(f"Cache follower query failed: {e}")
+                continue
+            for row in rows:
+                self.last_id = row.pop('id')
+                self.cache.add(row)
+
+    def stop(self):
+        self._stop_event.set()
+        self.join(self.interval * 2)
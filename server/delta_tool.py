@@ -0,0 +1,179 @@
+import argparse
+import hashlib
+import struct
+import sys
+
+# Patch layout (little-endian), applied on the device by ota_delta.c:
+#   header: "EDLT", u32 format version, u32 target size, u32 reserved,
+#           32-byte ELF SHA-256 of the source image, 32-byte SHA-256 of the target
+#   ops:    0x01 COPY   u32 source offset, u32 length
+#           0x02 INSERT u32 length, <length> literal bytes
+#           0x00 END
+DELTA_MAGIC = b'EDLT'
+DELTA_FORMAT_VERSION = 1
+HEADER_FMT = '<4sIII32s32s'
+HEADER_SIZE = struct.calcsize(HEADER_FMT)
+
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# A COPY costs 9 bytes, so shorter matches are cheaper sent as literals.
+MIN_MATCH = 32
+INDEX_STEP = 4
+
+APP_DESC_OFFSET = 0x20
+APP_DESC_MAGIC = 0xABCD5432
+APP_DESC_VERSION_OFFSET = APP_DESC_OFFSET + 16
+APP_DESC_ELF_SHA_OFFSET = APP_DESC_OFFSET + 144
+
+
+class DeltaError(Exception):
+    pass
+
+
+def app_elf_sha256(image):
+    if len(image) < APP_DESC_ELF_SHA_OFFSET + 32:
+        raise DeltaError('image too small')
+    magic, = struct.unpack_from('<I', image, APP_DESC_OFFSET)
+    if magic != APP_DESC_MAGIC:
+        raise DeltaError('no esp_app_desc_t found in image')
+    return bytes(image[APP_DESC_ELF_SHA_OFFSET:APP_DESC_ELF_SHA_OFFSET + 32])
+
+
+def app_version(image):
+    raw = image[APP_DESC_VERSION_OFFSET:APP_DESC_VERSION_OFFSET + 32]
+    return raw.split(b'\0', 1)[0].decode('ascii', 'replace')
+
+
+def _build_index(src):
+    index = {}
+    for off in range(0, len(src) - MIN_MATCH + 1, INDEX_STEP):
+        index.setdefault(src[off:off + MIN_MATCH], off)
+    return index
+
+
+def _emit_insert(ops, data):
+    if data:
+        ops.append(struct.pack('<BI', OP_INSERT, len(data)))
+        ops.append(bytes(data))
+
+
+def make_patch(src, dst):
+    src = bytes(src)
+    dst = bytes(dst)
+    index = _build_index(src)
+    ops = []
+    literal_start = 0
+    i = 0
+    while i + MIN_MATCH <= len(dst):
+        src_off = index.get(dst[i:i + MIN_MATCH])
+        if src_off is None:
+            i += 1
+            continue
+
+        start, s = i, src_off
+        while start > literal_start and s > 0 and dst[start - 1] == src[s - 1]:
+            start -= 1
+            s -= 1
+        end, e = i + MIN_MATCH, src_off + MIN_MATCH
+        while end < len(dst) and e < len(src) and dst[end] == src[e]:
+            end += 1
+            e += 1
+
+        _emit_insert(ops, dst[literal_start:start])
+        ops.append(struct.pack('<BII', OP_COPY, s, end - start))
+        literal_start = i = end
+
+    _emit_insert(ops, dst[literal_start:])
+    ops.append(struct.pack('<B', OP_END))
+
+    header = struct.pack(HEADER_FMT, DELTA_MAGIC, DELTA_FORMAT_VERSION, len(dst), 0,
+                         app_elf_sha256(src), hashlib.sha256(dst).digest())
+    return header + b''.join(ops)
+
+
+def apply_patch(src, patch):
+    if len(patch) < HEADER_SIZE:
+        raise DeltaError('truncated header')
+    magic, version, dst_size, _, src_sha, dst_sha = struct.unpack_from(HEADER_FMT, patch, 0)
+    if magic != DELTA_MAGIC or version != DELTA_FORMAT_VERSION:
+        raise DeltaError('bad patch header')
+    if app_elf_sha256(src) != src_sha:
+        raise DeltaError('patch was built against a different source image')
+
+    out = bytearray()
+    pos = HEADER_SIZE
+    while True:
+        if pos >= len(patch):
+            raise DeltaError('missing END op')
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        elif op == OP_COPY:
+            off, length = struct.unpack_from('<II', patch, pos)
+            pos += 8
+            if off + length > len(src):
+                raise DeltaError('COPY outside source image')
+            out += src[off:off + length]
+        elif op == OP_INSERT:
+            length, = struct.unpack_from('<I', patch, pos)
+            pos += 4
+            if pos + length > len(patch):
+                raise DeltaError('truncated INSERT')
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            raise DeltaError(f'unknown op 0x{op:02x}')
+        if len(out) > dst_size:
+            raise DeltaError('patch output exceeds target size')
+
+    if len(out) != dst_size or hashlib.sha256(out).digest() != dst_sha:
+        raise DeltaError('patched image does not match target hash')
+    return bytes(out)
+
+
+def _read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Build and verify delta OTA patches')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    p_make = sub.add_parser('make', help='build a patch from SRC to DST')
+    p_make.add_argument('src')
+    p_make.add_argument('dst')
+    p_make.add_argument('out')
+
+    p_verify = sub.add_parser('verify', help='apply PATCH to SRC and compare with DST')
+    p_verify.add_argument('src')
+    p_verify.add_argument('patch')
+    p_verify.add_argument('dst')
+
+    args = parser.parse_args(argv)
+
+    try:
+        if args.cmd == 'make':
+            src, dst = _read(args.src), _read(args.dst)
+            patch = make_patch(src, dst)
+            apply_patch(src, patch)
+            with open(args.out, 'wb') as f:
+                f.write(patch)
+            print(f"{app_version(src)} -> {app_version(dst)}: {len(patch)} bytes "
+                  f"({100.0 * len(patch) / len(dst):.1f}% of {len(dst)})")
+        else:
+            dst = _read(args.dst)
+            if apply_patch(_read(args.src), _read(args.patch)) != dst:
+                raise DeltaError('patched image differs from target')
+            print('Patch OK')
+    except DeltaError as e:
+        print(f"Error: {e}", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,223 @@
+import collections
+import fcntl
+import hashlib
+import io
+import os
+import queue
+import threading
+import time
+import zlib
+from datetime import datetime, timezone
+
+from flask import send_file
+
+from delta_tool import DeltaError, make_patch
+
+
+class Artifact:
+    __slots__ = ('name', 'data', 'sha256', 'crc32', 'etag', 'mtime')
+
+    def __init__(self, name, data, mtime):
+        self.name = name
+        self.data = data
+        self.sha256 = hashlib.sha256(data).hexdigest()
+        self.crc32 = zlib.crc32(data)
+        # ota_resume.c keeps at most 63 characters of ETag for If-Range
+        self.etag = self.sha256[:32]
+        self.mtime = datetime.fromtimestamp(mtime, timezone.utc)
+
+
+class FirmwareStore:
+    """Firmware images and deltas held in memory, addressed by content.
+
+    Files are read and hashed once per change (keyed by mtime and size), so
+    an update storm is served from memory instead of a file open and read
+    per request. The same bytes under two names are stored once.
+    """
+
+    def __init__(self, max_artifacts=8):
+        self.max_artifacts = max_artifacts
+        self._lock = threading.Lock()
+        self._by_path = collections.OrderedDict()
+        self._by_sha = {}
+
+    def get(self, path):
+        """The artifact for path, or None if it does not exist."""
+        try:
+            st = os.stat(path)
+        except FileNotFoundError:
+            return None
+        key = (st.st_mtime_ns, st.st_size)
+        with self._lock:
+            cached = self._by_path.get(path)
+            if cached and cached[0] == key:
+                self._by_path.move_to_end(path)
+                return cached[1]
+
+        with open(path, 'rb') as f:
+            data = f.read()
+        artifact = Artifact(os.path.basename(path), data, st.st_mtime)
+        with self._lock:
+            artifact = self._by_sha.setdefault(artifact.sha256, artifact)
+            self._by_path[path] = (key, artifact)
+            self._by_path.move_to_end(path)
+            while len(self._by_path) > self.max_artifacts:
+                self._by_path.popitem(last=False)
+            live = {entry[1].sha256 for entry in self._by_path.values()}
+            for sha in [sha for sha in self._by_sha if sha not in live]:
+                del self._by_sha[sha]
+        return artifact
+
+    def by_sha256(self, sha256):
+        with self._lock:
+            return self._by_sha.get(sha256)
+
+
+def serve(artifact, immutable=False):
+    """Answers with the artifact, honouring If-None-Match, Range and If-Range.
+
+    Content-addressed URLs never change, so they may be cached indefinitely;
+    named ones must be revalidated, which costs a 304 when nothing changed.
+    """
+    resp = send_file(io.BytesIO(artifact.data), mimetype='application/octet-stream',
+                     as_attachment=True, download_name=artifact.name, conditional=True,
+                     etag=artifact.etag, last_modified=artifact.mtime,
+                     max_age=31536000 if immutable else 0)
+    resp.headers['Cache-Control'] = 'public, max-age=31536000, immutable' if immutable else 'no-cache'
+    resp.headers['Accept-Ranges'] = 'bytes'
+    resp.headers['X-Firmware-CRC32'] = f"{artifact.crc32:08x}"
+    resp.headers['X-Firmware-SHA256'] = artifact.sha256
+    return resp
+
+
+class RolloutSlots:
+    """Caps how many nodes download a new image at the same time.
+
+    A node is only told about an update once it holds a slot. Slots live in
+    SQLite so every worker process sees the same ones; a slot is released
+    when the node reports the new version, or expires after `lease` seconds
+    so a node that died mid-download does not hold it forever. The download
+    spans several wakes (ota_resume.c), so the lease must cover a few of them.
+    """
+
+    def __init__(self, pool, max_concurrent=20, lease=3600):
+        self.pool = pool
+        self.max_concurrent = max_concurrent
+        self.lease = lease
+
+    def acquire(self, device, running, target, max_concurrent=None, lease=None):
+        """Whether device may fetch target now; running is the version it reports."""
+        max_concurrent = self.max_concurrent if max_concurrent is None else max_concurrent
+        lease = self.lease if lease is None else lease
+        now = int(time.time())
+        with self.pool.connection() as conn:
+            # Reads first: most calls are up-to-date nodes or nodes still waiting
+            slot = conn.execute('SELECT version, granted FROM rollout WHERE device = ?', (device,)).fetchone()
+            if running == target:
+                if slot:
+                    with conn:
+                        conn.execute('DELETE FROM rollout WHERE device = ?', (device,))
+                return False
+            if slot and slot[0] == target and slot[1] >= now - lease:
+                return True
+            active = conn.execute('SELECT COUNT(*) FROM rollout WHERE version = ? AND granted >= ?',
+                                  (target, now - lease)).fetchone()[0]
+            if active >= max_concurrent:
+                return False
+
+            with conn:
+                # The DELETE takes the database write lock, so the recount cannot
+                # race a grant in another worker
+                conn.execute('DELETE FROM rollout WHERE granted < ? OR version != ?', (now - lease, target))
+                active = conn.execute('SELECT COUNT(*) FROM rollout').fetchone()[0]
+                if active >= max_concurrent:
+                    return False
+                conn.execute('INSERT OR REPLACE INTO rollout (device, version, granted) VALUES (?, ?, ?)',
+                             (device, target, now))
+                return True
+
+    def active(self, target):
+        with self.pool.connection() as conn:
+            return conn.execute('SELECT COUNT(*) FROM rollout WHERE version = ? AND granted >= ?',
+                                (target, int(time.time()) - self.lease)).fetchone()[0]
+
+
+class DeltaBuilder(threading.Thread):
+    """Builds firmware deltas off the request path, one at a time.
+
+    A patch is named after the SHA-256 of its base and target images, so an
+    image replaced under the same version never gets a patch built for the
+    old bytes. A pair that cannot be patched, or whose patch would not be
+    smaller than the image, gets an empty .none marker so it is not retried.
+    A lock file keeps gunicorn workers from building the same patch at once.
+    """
+
+    def __init__(self, delta_dir):
+        super().__init__(name='delta-builder', daemon=True)
+        self.delta_dir = delta_dir
+        self._queue = queue.Queue()
+        self._lock = threading.Lock()
+        self._pending = set()
+
+    def path(self, base_sha256, target_sha256):
+        return os.path.join(self.delta_dir, f"{base_sha256[:16]}-{target_sha256[:16]}.patch")
+
+    def unusable(self, base_sha256, target_sha256):
+        return os.path.exists(self.path(base_sha256, target_sha256) + '.none')
+
+    def submit(self, base_file, target_file):
+        """Queues a build for the images now at these paths; repeats are dropped."""
+        with self._lock:
+            if (base_file, target_file) in self._pending:
+                return
+            self._pending.add((base_file, target_file))
+        self._queue.put((base_file, target_file))
+
+    def run(self):
+        while True:
+            job = self._queue.get()
+            if job is None:
+                return
+            try:
+                self._build(*job)
+            except Exception as e:
+                print(f"Delta build for {os.path.basename(job[0])} failed: {e}")
+            finally:
+                with self._lock:
+                    self._pending.discard(job)
+
+    def _build(self, base_file, target_file):
+        with open(base_file, 'rb') as f:
+            base = f.read()
+        with open(target_file, 'rb') as f:
+            target = f.read()
+        if base == target:
+            return
+        delta_file = self.path(hashlib.sha256(base).hexdigest(), hashlib.sha256(target).hexdigest())
+        os.makedirs(self.delta_dir, exist_ok=True)
+        with open(os.path.join(self.delta_dir, '.build.lock'), 'w') as lock:
+            fcntl.flock(lock, fcntl.LOCK_EX)
+            # Another worker may have built it while this one waited
+            if os.path.exists(delta_file) or os.path.exists(delta_file + '.none'):
+                return
+            try:
+                patch = make_patch(base, target)
+                reason = 'delta larger than full image' if len(patch) >= len(target) else None
+            except DeltaError as e:
+                reason = str(e)
+            out_file = delta_file + '.none' if reason else delta_file
+            tmp_file = f"{out_file}.{os.getpid()}.tmp"
+            with open(tmp_file, 'wb') as f:
+                if not reason:
+                    f.write(patch)
+            os.replace(tmp_file, out_file)
+        name = os.path.basename(delta_file)
+        if reason:
+            print(f"No delta {name} from {os.path.basename(base_file)}: {reason}")
+        else:
+            print(f"Built delta {name} from {os.path.basename(base_file)}: {len(patch)} bytes "
+                  f"(full image {len(target)} bytes)")
+
+    def stop(self, timeout=5.0):
+        self._queue.put(None)
+        self.join(timeout)
@@ -0,0 +1,51 @@
+import multiprocessing
+import os
+
+# Production serving mode:
+#
+#   cd server && gunicorn -c gunicorn.conf.py server:app
+#
+# gunicorn listens on plain HTTP behind a TLS-terminating proxy (nginx.conf).
+# Set CERT_FILE and KEY_FILE to have gunicorn terminate TLS itself instead.
+
+bind = os.environ.get('BIND', '127.0.0.1:8000')
+
+# Each worker process runs its own ingest writer against the shared SQLite
+# file; beyond a few of them they only contend for its write lock.
+workers = int(os.environ.get('WEB_CONCURRENCY', min(4, multiprocessing.cpu_count())))
+# Threads, because /sensor/batch blocks until its rows are stored
+worker_class = 'gthread'
+threads = int(os.environ.get('THREADS', 8))
+
+# Longer than IngestQueue.submit()'s 10 s wait
+timeout = 30
+# Time a stopping worker gets to finish requests and drain its ingest queue
+graceful_timeout = 30
+keepalive = 5
+
+if os.environ.get('CERT_FILE'):
+    certfile = os.environ['CERT_FILE']
+    keyfile = os.environ['KEY_FILE']
+
+# Nothing with threads or sockets is created at import, so forking a loaded app is safe
+preload_app = True
+
+
+def on_starting(server):
+    # Migrate once in the master rather than racing in every worker
+    import metrics
+    import storage
+    from server import DB_FILE, METRICS_DIR
+    storage.init_db(DB_FILE)
+    # Counters of a previous run's workers must not add to this one's
+    metrics.clear(METRICS_DIR)
+
+
+def post_worker_init(worker):
+    from server import start_services
+    start_services()
+
+
+def worker_exit(server, worker):
+    from server import stop_services
+    stop_services()
@@ -0,0 +1,272 @@
+import collections
+import os
+import random
+import threading
+import time
+
+from influxdb_client import WritePrecision
+from influxdb_client.client.write_api import SYNCHRONOUS
+from influxdb_client.rest import ApiException
+
+import metrics
+from ingest import percentiles
+
+# InfluxDB rejects these for the data itself (bad line protocol, field type
+# conflict); sending them again cannot succeed, so the batch is dropped
+PERMANENT_STATUS = (400, 422)
+
+WRITE_TIME = metrics.REGISTRY.histogram(
+    'sensor_influx_write_seconds', 'Duration of one successful InfluxDB write request')
+
+
+class InfluxWriter:
+    """Batches points into line protocol writes to InfluxDB.
+
+    write() only converts and queues, so callers never wait on the network.
+    A thread sends up to batch_size lines per request, at least every
+    flush_interval seconds. A failed write is retried with exponential
+    backoff; while InfluxDB is unavailable, lines beyond max_buffered and
+    batches that failed go to spool_dir, which is replayed oldest first once
+    writes succeed again. The spool is shared by all worker processes and
+    capped at max_spool_bytes, beyond which the oldest files are dropped.
+
+    Every point must carry its own timestamp; a point without one would be
+    stamped with the time of the (possibly much later) successful write.
+    """
+
+    def __init__(self, client, bucket, spool_dir, batch_size=5000, flush_interval=1.0,
+                 max_buffered=50000, retry_initial=1.0, retry_max=60.0, max_spool_bytes=512 << 20):
+        self.bucket = bucket
+        self.spool_dir = spool_dir
+        self.batch_size = batch_size
+        self.flush_interval = flush_interval
+        self.max_buffered = max_buffered
+        self.retry_initial = retry_initial
+        self.retry_max = retry_max
+        self.max_spool_bytes = max_spool_bytes
+        self._write_api = client.write_api(write_options=SYNCHRONOUS)
+        self._lines = collections.deque()
+        self._cond = threading.Condition()
+        self._closing = False
+        self._backoff = 0.0
+        self._retry_at = 0.0
+        self._spool_seq = 0
+        self._thread = threading.Thread(target=self._run, name='influx-writer', daemon=True)
+        self._write_ms = collections.deque(maxlen=1024)
+        self._stats = {
+            'queued': 0,
+            'written': 0,
+            'batches': 0,
+            'write_errors': 0,
+            'dropped': 0,
+            'spilled': 0,
+            'replayed': 0,
+            'spool_files_dropped': 0,
+            'last_error': None,
+        }
+        os.makedirs(spool_dir, exist_ok=True)
+        self._recover_claims()
+
+    def start(self):
+        self._thread.start()
+
+    def close(self, timeout=10.0):
+        """Sends what is buffered if InfluxDB is reachable and spools the rest."""
+        with self._cond:
+            self._closing = True
+            self._cond.notify()
+        self._thread.join(timeout)
+        with self._cond:
+            lines = list(self._lines)
+            self._lines.clear()
+        if lines:
+            self._spill(lines)
+        self._write_api.close()
+
+    def write(self, points):
+        lines = [point.to_line_protocol(precision=WritePrecision.S) for point in points]
+        overflow = []
+        with self._cond:
+            self._lines.extend(lines)
+            self._stats['queued'] += len(lines)
+            while len(self._lines) > self.max_buffered:
+                overflow.append(self._take(self.batch_size))
+            # While backing off the thread sleeps until _retry_at however full the buffer is
+            if len(self._lines) >= self.batch_size and time.monotonic() >= self._retry_at:
+                self._cond.notify()
+        for batch in overflow:
+            self._spill(batch)
+
+    def stats(self):
+        with self._cond:
+            stats = dict(self._stats)
+            stats['buffered'] = len(self._lines)
+            stats['write_ms'] = percentiles(self._write_ms)
+            stats['backoff_s'] = self._backoff
+        files, size = 0, 0
+        for entry in os.scandir(self.spool_dir):
+            if entry.name.endswith('.lp'):
+                files += 1
+                size += entry.stat().st_size
+        stats['spool_files'] = files
+        stats['spool_bytes'] = size
+        return stats
+
+    def _take(self, n):
+        return [self._lines.popleft() for _ in range(min(n, len(self._lines)))]
+
+    def _send(self, lines):
+        """Writes lines; False means try again later, a permanent rejection counts as done."""
+        start = time.monotonic()
+        try:
+            self._write_api.write(bucket=self.bucket, record=lines, write_precision=WritePrecision.S)
+        except ApiException as e:
+            if e.status in PERMANENT_STATUS:
+                print(f"InfluxDB rejected {len(lines)} lines, dropping them: {e.status} {e.body}")
+                self._failed(f'{e.status} {e.reason}', dropped=len(lines))
+                return True
+            retry_after = (e.headers or {}).get('Retry-After')
+            delay = float(retry_after) if retry_after and retry_after.isdigit() else None
+            self._failed(f'{e.status} {e.reason}', delay)
+            return False
+        except Exception as e:
+            self._failed(str(e))
+            return False
+
+        elapsed = time.monotonic() - start
+        WRITE_TIME.observe(elapsed)
+        with self._cond:
+            self._write_ms.append(elapsed * 1000)
+            self._stats['written'] += len(lines)
+            self._stats['batches'] += 1
+            self._backoff = 0.0
+        return True
+
+    def _failed(self, error, delay=None, dropped=0):
+        with self._cond:
+            self._stats['write_errors'] += 1
+            self._stats['dropped'] += dropped
+            self._stats['last_error'] = error
+            if dropped:
+                return
+            self._backoff = min(self.retry_max, self._backoff * 2 or self.retry_initial)
+            # Jitter keeps the workers from retrying in lockstep
+            wait = delay if delay is not None else self._backoff * random.uniform(0.5, 1.0)
+            self._retry_at = time.monotonic() + wait
+        print(f"InfluxDB write failed, retrying in {wait:.1f} s: {error}")
+
+    def _spill(self, lines):
+        name = f'{time.time_ns():020d}-{os.getpid()}-{self._spool_seq}.lp'
+        self._spool_seq += 1
+        path = os.path.join(self.spool_dir, name)
+        try:
+            with open(path + '.tmp', 'w') as f:
+                f.write('\n'.join(lines))
+            os.replace(path + '.tmp', path)
+        except OSError as e:
+            print(f"Spooling {len(lines)} lines failed, dropping them: {e}")
+            with self._cond:
+                self._stats['dropped'] += len(lines)
+            return
+        with self._cond:
+            self._stats['spilled'] += len(lines)
+        self._trim_spool()
+
+    def _spooled(self):
+        return sorted(name for name in os.listdir(self.spool_dir) if name.endswith('.lp'))
+
+    def _trim_spool(self):
+        names = self._spooled()
+        sizes = {}
+        for name in names:
+            try:
+                sizes[name] = os.path.getsize(os.path.join(self.spool_dir, name))
+            except FileNotFoundError:
+                pass
+        total = sum(sizes.values())
+        for name in names:
+            if total <= self.max_spool_bytes:
+                break
+            try:
+                os.remove(os.path.join(self.spool_dir, name))
+            except FileNotFoundError:
+                continue
+            total -= sizes.get(name, 0)
+            print(f"InfluxDB spool over {self.max_spool_bytes} bytes, dropped {name}")
+            with self._cond:
+                self._stats['spool_files_dropped'] += 1
+
+    def _recover_claims(self):
+        # A worker renames a spool file to <name>.<pid> while replaying it; one
+        # that died meanwhile leaves the claim behind
+        for name in os.listdir(self.spool_dir):
+            base, _, pid = name.rpartition('.')
+            if not base.endswith('.lp') or not pid.isdigit():
+                continue
+            try:
+                os.kill(int(pid), 0)
+                continue
+            except ProcessLookupError:
+                pass
+            except PermissionError:
+                continue
+            try:
+                os.rename(os.path.join(self.spool_dir, name), os.path.join(self.spool_dir, base))
+            except FileNotFoundError:
+                pass
+
+    def _replay(self):
+        """Sends spooled files oldest first; False when a write failed."""
+        for name in self._spooled():
+            path = os.path.join(self.spool_dir, name)
+            claimed = f'{path}.{os.getpid()}'
+            try:
+                os.rename(path, claimed)
+            except FileNotFoundError:
+                continue  # another worker took it
+            with open(claimed) as f:
+                lines = f.read().split('\n')
+            if not self._send(lines):
+                os.rename(claimed, path)
+                return False
+            os.remove(claimed)
+            with self._cond:
+                self._stats['replayed'] += len(lines)
+        return True
+
+    def _run(self):
+        next_replay = 0.0
+        while True:
+            with self._cond:
+                deadline = time.monotonic() + self.flush_interval
+                while not self._closing:
+                    now = time.monotonic()
+                    if now < self._retry_at:
+                        # Backing off: a full buffer must not wake this loop, or it spins
+                        self._cond.wait(self._retry_at - now)
+                    elif len(self._lines) >= self.batch_size or now >= deadline:
+                        break
+                    else:
+                        self._cond.wait(deadline - now)
+                closing = self._closing
+
+            if closing and time.monotonic() < self._retry_at:
+                # Still backing off; close() spools whatever is left
+                return
+
+            # Spooled lines are older, so they go first; the spool is rescanned
+            # now and then for files other workers left behind
+            if self._backoff or time.monotonic() >= next_replay:
+                next_replay = time.monotonic() + 30
+                if not self._replay():
+                    continue
+            while True:
+                with self._cond:
+                    batch = self._take(self.batch_size)
+                if not batch:
+                    break
+                if not self._send(batch):
+                    self._spill(batch)
+                    break
+            if closing:
+                return
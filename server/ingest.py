@@ -0,0 +1,208 @@
+import collections
+import fcntl
+import queue
+import threading
+import time
+
+import metrics
+import rollup
+import storage
+
+SQLITE_WRITE = metrics.REGISTRY.histogram(
+    'sensor_sqlite_write_seconds', 'Duration of one ingest batch transaction (raw rows and rollups)')
+QUEUE_WAIT = metrics.REGISTRY.histogram(
+    'sensor_ingest_queue_wait_seconds', 'Time the oldest item of a batch spent queued before its write')
+
+
+class IngestFull(Exception):
+    pass
+
+
+def percentiles(samples):
+    if not samples:
+        return {'p50': 0.0, 'p99': 0.0, 'max': 0.0}
+    ordered = sorted(samples)
+    return {
+        'p50': ordered[len(ordered) // 2],
+        'p99': ordered[min(len(ordered) - 1, len(ordered) * 99 // 100)],
+        'max': ordered[-1],
+    }
+
+
+class _Item:
+    __slots__ = ('rows', 'points', 'enqueued', 'done', 'ok')
+
+    def __init__(self, rows, points, wait):
+        self.rows = rows
+        self.points = points
+        self.enqueued = time.monotonic()
+        self.done = threading.Event() if wait else None
+        self.ok = False
+
+
+class IngestQueue:
+    """Moves SQLite and InfluxDB writes off the request path.
+
+    Handlers validate, build rows and points, and submit() them; a single
+    writer thread drains the queue in batches, one SQLite transaction per
+    batch, and hands the points to the InfluxWriter, which sends them on its
+    own. The queue is bounded: when it is full submit()
+    raises IngestFull so the handler can answer 503 and the device keeps the
+    reading in its flash journal instead of the server buffering without limit.
+
+    Rollup tiers are updated in the same transaction as the raw rows, and
+    every maintenance_interval seconds the writer also archives closed days,
+    applies retention and exports changed rollups. Under gunicorn every
+    worker runs its own IngestQueue on the same database, and RolloutSlots
+    writes from request handlers, so these writers take turns through
+    SQLite's locking (WAL, busy timeout); anything that reads and then
+    updates based on what it read must do both in one BEGIN IMMEDIATE.
+    """
+
+    def __init__(self, db_file, influx, max_items=1000, batch_max=200, flush_interval=0.2,
+                 maintenance_interval=3600, archive_dir=None):
+        self.db_file = db_file
+        self.archive_dir = archive_dir
+        self.influx = influx
+        self.batch_max = batch_max
+        self.flush_interval = flush_interval
+        self.maintenance_interval = maintenance_interval
+        self._queue = queue.Queue(maxsize=max_items)
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, name='ingest-writer', daemon=True)
+        self._lock = threading.Lock()
+        # Per-batch durations of the most recent writes, for latency percentiles
+        self._sqlite_ms = collections.deque(maxlen=1024)
+        self._stats = {
+            'enqueued': 0,
+            'rejected': 0,
+            'written': 0,
+            'batches': 0,
+            'write_errors': 0,
+            'high_water': 0,
+            'last_batch_size': 0,
+            'last_write_ms': 0.0,
+            'max_queue_wait_ms': 0.0,
+        }
+
+    def start(self):
+        self._thread.start()
+
+    def stop(self, timeout=5.0):
+        """Writes out whatever is still queued, then stops the writer."""
+        self._stop.set()
+        self._thread.join(timeout)
+
+    def submit(self, rows, points, wait=False, timeout=10.0):
+        """Queues rows and points for writing.
+
+        With wait=True, blocks until they are stored and returns whether the
+        write succeeded; callers that acknowledge data as durable use this.
+        """
+        item = _Item(rows, points, wait)
+        try:
+            self._queue.put_nowait(item)
+        except queue.Full:
+            with self._lock:
+                self._stats['rejected'] += 1
+            raise IngestFull()
+
+        with self._lock:
+            self._stats['enqueued'] += 1
+            self._stats['high_water'] = max(self._stats['high_water'], self._queue.qsize())
+
+        if not wait:
+            return True
+        return item.done.wait(timeout) and item.ok
+
+    def stats(self):
+        with self._lock:
+            stats = dict(self._stats)
+        stats['depth'] = self._queue.qsize()
+        stats['capacity'] = self._queue.maxsize
+        with self._lock:
+            stats['sqlite_write_ms'] = percentiles(self._sqlite_ms)
+        return stats
+
+    def _next_batch(self):
+        try:
+            batch = [self._queue.get(timeout=self.flush_interval)]
+        except queue.Empty:
+            return []
+        # Whatever else arrived meanwhile goes into the same transaction
+        while len(batch) < self.batch_max:
+            try:
+                batch.append(self._queue.get_nowait())
+            except queue.Empty:
+                break
+        return batch
+
+    def _write(self, conn, batch):
+        rows = [row for item in batch for row in item.rows]
+        points = [point for item in batch for point in item.points]
+
+        start = time.monotonic()
+        stored = True
+        try:
+            with conn:
+                conn.executemany(storage.INSERT_SQL, rows)
+                rollup.apply(conn, rows)
+        except Exception as e:
+            # A bad row must fail its batch, not end the writer thread
+            print(f"SQLite batch write failed: {e}")
+            stored = False
+        ok = stored
+        finished = time.monotonic()
+        try:
+            # Only queues; retries and spooling are the InfluxWriter's business
+            self.influx.write(points)
+        except Exception as e:
+            print(f"InfluxDB points rejected: {e}")
+            ok = False
+
+        for item in batch:
+            item.ok = ok
+            if item.done:
+                item.done.set()
+
+        with self._lock:
+            self._stats['batches'] += 1
+            # Rolled back rows were not written, whatever happened to their points
+            if stored:
+                self._stats['written'] += len(rows)
+            self._stats['last_batch_size'] = len(rows)
+            self._stats['last_write_ms'] = (finished - start) * 1000
+            self._sqlite_ms.append((finished - start) * 1000)
+            self._stats['max_queue_wait_ms'] = max(self._stats['max_queue_wait_ms'],
+                                                   (start - batch[0].enqueued) * 1000)
+            if not ok:
+                self._stats['write_errors'] += 1
+        SQLITE_WRITE.observe(finished - start)
+        QUEUE_WAIT.observe(start - batch[0].enqueued)
+
+    def _run(self):
+        # The connection belongs to this thread only
+        conn = storage.connect(self.db_file)
+        next_maintenance = time.monotonic()
+        try:
+            while not (self._stop.is_set() and self._queue.empty()):
+                batch = self._next_batch()
+                if batch:
+                    self._write(conn, batch)
+                if time.monotonic() >= next_maintenance and not self._stop.is_set():
+                    next_maintenance = time.monotonic() + self.maintenance_interval
+                    self._maintain(conn)
+        finally:
+            conn.close()
+
+    def _maintain(self, conn):
+        # Every worker process has a writer; only one of them does maintenance at a time
+        with open(self.db_file + '.maintenance.lock', 'w') as lock:
+            try:
+                fcntl.flock(lock, fcntl.LOCK_EX | fcntl.LOCK_NB)
+            except BlockingIOError:
+                return
+            try:
+                rollup.maintain(conn, self.influx, self.archive_dir)
+            except Exception as e:
+                print(f"Rollup maintenance failed: {e}")
@@ -0,0 +1,342 @@
+import argparse
+import heapq
+import http.client
+import http.server
+import json
+import random
+import ssl
+import statistics
+import struct
+import sys
+import threading
+import time
+import zlib
+from urllib.parse import urlsplit
+
+# Simulates a fleet of sensor nodes against a running server.py and reports
+# what one instance sustains.
+#
+# Every simulated node wakes once per --period seconds (+/- --jitter), opens
+# a fresh TLS connection like the firmware does, and POSTs its reading to
+# /sensor. With --batch-ratio a share of wakes instead drains a journal batch
+# to /sensor/batch. Wakes are scheduled in advance; if the worker pool cannot
+# start them on time the lag is reported, which means the generator or the
+# server is saturated. /ingest/stats is read before and after to report the
+# server's SQLite and InfluxDB write latency.
+#
+# --fake-influx PORT starts a stand-in InfluxDB that accepts writes (with
+# optional --influx-delay) so the server can be benchmarked without one:
+#
+#   python loadgen.py --fake-influx 8086 --standin-only &
+#   INFLUX_URL=http://localhost:8086 python server.py
+#   python loadgen.py --url https://localhost:5000 --insecure --devices 2000 --period 60 --duration 120
+
+JOURNAL_RECORD = struct.Struct('<IIfffIHBB')
+FIRMWARE_VERSION = 'loadgen'
+
+
+class FakeInflux(http.server.BaseHTTPRequestHandler):
+    delay = 0.0
+    writes = 0
+    lines = 0
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        time.sleep(self.delay)
+        FakeInflux.writes += 1
+        FakeInflux.lines += body.count(b'\n') + 1
+        self.send_response(204)
+        self.end_headers()
+
+    def do_GET(self):
+        # /health and /ping
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.end_headers()
+        self.wfile.write(b'{"status":"pass"}')
+
+    def log_message(self, *args):
+        pass
+
+
+def start_fake_influx(port, delay):
+    FakeInflux.delay = delay
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', port), FakeInflux)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+class Node:
+    def __init__(self, index):
+        self.id = f'{0x02 << 40 | index:012x}'  # locally administered MAC range
+        self.seq = 0
+        self.temperature = random.uniform(18, 26)
+        self.humidity = random.uniform(30, 60)
+
+    def reading(self):
+        self.temperature += random.gauss(0, 0.05)
+        self.humidity += random.gauss(0, 0.2)
+        return {
+            'id': self.id,
+            'fw': FIRMWARE_VERSION,
+            'temperature': round(self.temperature, 2),
+            'humidity': round(self.humidity, 2),
+            'pressure': round(random.uniform(100500, 102000), 2),
+            'gas_resistance': random.randint(50000, 300000),
+            'iaq': round(random.uniform(20, 120), 1),
+            'iaq_acc': 3,
+            'ts': int(time.time()),
+            'net': {
+                'rssi': random.randint(-85, -45), 'ch': 6, 'conn_ms': random.randint(800, 3000),
+                'dhcp_ms': random.randint(100, 600), 'retries': 0, 'tls_ms': random.randint(300, 900),
+                'status': 200, 'fails': 0, 'heap': 180000, 'heap_min': 160000, 'reset': 8,
+            },
+        }
+
+    def journal_batch(self, count):
+        out = bytearray()
+        now = int(time.time())
+        for i in range(count):
+            self.seq += 1
+            r = self.reading()
+            raw = JOURNAL_RECORD.pack(self.seq, now - (count - i) * 300, r['temperature'], r['humidity'],
+                                      r['pressure'], r['gas_resistance'], int(r['iaq'] * 10), 3, 0)
+            out += raw + struct.pack('<I', zlib.crc32(raw))
+        return bytes(out)
+
+
+class Client:
+    def __init__(self, url, context, keep_alive, timeout):
+        parts = urlsplit(url)
+        self.https = parts.scheme == 'https'
+        self.host = parts.hostname
+        self.port = parts.port or (443 if self.https else 80)
+        self.base = parts.path.rstrip('/')
+        self.context = context
+        self.keep_alive = keep_alive
+        self.timeout = timeout
+        self._local = threading.local()
+
+    def _connection(self):
+        conn = getattr(self._local, 'conn', None) if self.keep_alive else None
+        if conn is None:
+            if self.https:
+                conn = http.client.HTTPSConnection(self.host, self.port, timeout=self.timeout,
+                                                   context=self.context)
+            else:
+                conn = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+            self._local.conn = conn
+        return conn
+
+    def request(self, method, path, body=None, headers=None):
+        conn = self._connection()
+        try:
+            conn.request(method, self.base + path, body=body, headers=headers or {})
+            resp = conn.getresponse()
+            data = resp.read()
+            return resp.status, data
+        finally:
+            if not self.keep_alive:
+                conn.close()
+                self._local.conn = None
+
+    def get_json(self, path):
+        try:
+            status, data = self.request('GET', path)
+            return json.loads(data) if status == 200 else None
+        except (OSError, http.client.HTTPException, ValueError):
+            return None
+
+
+class Results:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latency = {'sensor': [], 'batch': []}
+        self.status = {}
+        self.lag = []
+        self.records = 0
+
+    def add(self, kind, status, seconds, lag, records=0):
+        with self.lock:
+            if status == 200:
+                self.latency[kind].append(seconds * 1000)
+                self.records += records
+            self.status[status] = self.status.get(status, 0) + 1
+            self.lag.append(lag)
+
+
+def run_load(args, client):
+    nodes = [Node(i) for i in range(args.devices)]
+    results = Results()
+    start = time.monotonic() + 0.5
+    end = start + args.duration
+
+    # First wakes spread over one period, as a fleet that booted at random times
+    schedule = [(start + random.uniform(0, args.period), i) for i in range(len(nodes))]
+    heapq.heapify(schedule)
+    schedule_lock = threading.Lock()
+    # Larger jitter would schedule a node's next wake before its current one
+    jitter = min(args.jitter, args.period / 2)
+
+    def worker():
+        while True:
+            with schedule_lock:
+                due, i = heapq.heappop(schedule)
+                if due >= end:
+                    heapq.heappush(schedule, (due, i))
+                    return
+                heapq.heappush(schedule, (due + args.period + random.uniform(-jitter, jitter), i))
+            now = time.monotonic()
+            if due > now:
+                time.sleep(due - now)
+            node = nodes[i]
+
+            if random.random() < args.batch_ratio:
+                kind, records = 'batch', random.randint(1, 64)
+                body = node.journal_batch(records)
+                path = '/sensor/batch'
+                headers = {'Content-Type': 'application/octet-stream', 'X-Device-Id': node.id,
+                           'X-Firmware-Version': FIRMWARE_VERSION}
+            else:
+                kind, records = 'sensor', 1
+                body = json.dumps(node.reading())
+                path = '/sensor'
+                headers = {'Content-Type': 'application/json'}
+
+            t0 = time.monotonic()
+            try:
+                status, _ = client.request('POST', path, body, headers)
+            except (OSError, http.client.HTTPException) as e:
+                status = type(e).__name__
+            results.add(kind, status, time.monotonic() - t0, t0 - due, records)
+
+    threads = [threading.Thread(target=worker, daemon=True) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return results, time.monotonic() - start
+
+
+def percentile(values, pct):
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+def report(args, results, elapsed, before, after):
+    total = sum(results.status.values())
+    ok = results.status.get(200, 0)
+    out = {
+        'devices': args.devices,
+        'period_s': args.period,
+        'duration_s': round(elapsed, 1),
+        'requests': total,
+        'requests_per_s': round(total / elapsed, 1),
+        'ok_per_s': round(ok / elapsed, 1),
+        'records_per_s': round(results.records / elapsed, 1),
+        'status': {str(k): v for k, v in sorted(results.status.items(), key=str)},
+        'error_rate': round(1 - ok / total, 4) if total else 0.0,
+        'schedule_lag_ms_p99': round(percentile(results.lag, 99) * 1000, 1),
+    }
+    for kind, values in results.latency.items():
+        if values:
+            out[f'{kind}_latency_ms'] = {
+                'p50': round(statistics.median(values), 1),
+                'p99': round(percentile(values, 99), 1),
+                'max': round(max(values), 1),
+            }
+    if after:
+        out['server'] = {
+            'rows_written': after['written'] - (before or {}).get('written', 0),
+            'rejected': after['rejected'] - (before or {}).get('rejected', 0),
+            'write_errors': after['write_errors'] - (before or {}).get('write_errors', 0),
+            'queue_high_water': after['high_water'],
+            'sqlite_write_ms': after.get('sqlite_write_ms'),
+            'influx_write_ms': after.get('influx', {}).get('write_ms'),
+        }
+    if args.fake_influx:
+        out['fake_influx'] = {'writes': FakeInflux.writes, 'lines': FakeInflux.lines}
+    return out
+
+
+def print_report(r):
+    print()
+    print(f"{r['devices']} nodes, one wake per {r['period_s']} s, {r['duration_s']} s run")
+    print(f"  requests      {r['requests']} ({r['requests_per_s']}/s, {r['ok_per_s']}/s ok, "
+          f"{r['records_per_s']} records/s)")
+    print(f"  status        {r['status']}  error rate {r['error_rate'] * 100:.2f}%")
+    for kind in ('sensor', 'batch'):
+        lat = r.get(f'{kind}_latency_ms')
+        if lat:
+            print(f"  {kind:13} p50 {lat['p50']} ms  p99 {lat['p99']} ms  max {lat['max']} ms")
+    print(f"  schedule lag  p99 {r['schedule_lag_ms_p99']} ms")
+    server = r.get('server')
+    if server:
+        print(f"  server        {server['rows_written']} rows written, {server['rejected']} rejected, "
+              f"{server['write_errors']} write errors, queue high water {server['queue_high_water']}")
+        for name in ('sqlite', 'influx'):
+            lat = server.get(f'{name}_write_ms')
+            if lat:
+                print(f"  {name:13} per batch p50 {lat['p50']:.2f} ms  p99 {lat['p99']:.2f} ms  "
+                      f"max {lat['max']:.2f} ms")
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Load-test the sensor ingestion server')
+    parser.add_argument('--url', default='https://localhost:5000', help='server base URL')
+    parser.add_argument('--devices', type=int, default=100, help='simulated nodes')
+    parser.add_argument('--period', type=float, default=300.0, help='seconds between wakes of one node')
+    parser.add_argument('--jitter', type=float, default=5.0, help='+/- seconds of wake jitter')
+    parser.add_argument('--duration', type=float, default=60.0, help='seconds to run')
+    parser.add_argument('--batch-ratio', type=float, default=0.05,
+                        help='share of wakes that drain a journal batch instead')
+    parser.add_argument('--concurrency', type=int, default=64, help='client threads')
+    parser.add_argument('--keep-alive', action='store_true',
+                        help='reuse connections (nodes reconnect every wake)')
+    parser.add_argument('--timeout', type=float, default=10.0, help='request timeout, as on the node')
+    parser.add_argument('--ca', default='certs/cert.pem', help='CA bundle for the server certificate')
+    parser.add_argument('--insecure', action='store_true', help='skip certificate verification')
+    parser.add_argument('--fake-influx', type=int, metavar='PORT', help='run a stand-in InfluxDB')
+    parser.add_argument('--influx-delay', type=float, default=0.0, help='stand-in write latency, seconds')
+    parser.add_argument('--standin-only', action='store_true', help='only run the stand-in InfluxDB')
+    parser.add_argument('--json', metavar='FILE', help='also write the report as JSON')
+    args = parser.parse_args(argv)
+
+    if args.fake_influx:
+        start_fake_influx(args.fake_influx, args.influx_delay)
+        print(f'Stand-in InfluxDB on http://127.0.0.1:{args.fake_influx}')
+        if args.standin_only:
+            try:
+                while True:
+                    time.sleep(3600)
+            except KeyboardInterrupt:
+                return 0
+
+    context = None
+    if urlsplit(args.url).scheme == 'https':
+        if args.insecure:
+            context = ssl._create_unverified_context()
+        else:
+            context = ssl.create_default_context(cafile=args.ca)
+    client = Client(args.url, context, args.keep_alive, args.timeout)
+
+    before = client.get_json('/ingest/stats')
+    print(f'{args.devices} nodes, period {args.period} s, {args.duration} s '
+          f'(~{args.devices / args.period:.1f} wakes/s offered)')
+    results, elapsed = run_load(args, client)
+    # Let the writer catch up so its counters include this run
+    time.sleep(1.0)
+    after = client.get_json('/ingest/stats')
+
+    r = report(args, results, elapsed, before, after)
+    print_report(r)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(r, f, indent=2)
+    return 0 if r['error_rate'] < 0.01 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
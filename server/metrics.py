@@ -0,0 +1,234 @@
+import json
+import math
+import os
+import threading
+
+# Prometheus text exposition for a server that runs as several processes.
+#
+# Each worker keeps its own counters, gauges and histograms in a Registry and
+# writes them to <directory>/<pid>.json every few seconds. /metrics, answered
+# by whichever worker gets the scrape, adds up the snapshots of all workers.
+# Counters and histograms of workers that have exited are kept so totals do
+# not go backwards while the server runs; their gauges are left out. The
+# directory is cleared when the server starts.
+
+CONTENT_TYPE = 'text/plain; version=0.0.4; charset=utf-8'
+
+# Seconds; from a cached /latest up to a /sensor/batch that waits on a busy queue
+LATENCY_BUCKETS = (0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0)
+# Bytes; a /sensor JSON body is a few hundred, a full journal batch a few kilobytes
+SIZE_BUCKETS = (128, 256, 512, 1024, 2048, 4096, 8192, 16384, 65536)
+
+
+def _key(labels):
+    return tuple(str(label) for label in labels)
+
+
+class Metric:
+    def __init__(self, registry, kind, name, help, labels=(), buckets=None):
+        self.kind = kind
+        self.name = name
+        self.help = help
+        self.labels = tuple(labels)
+        self.buckets = tuple(buckets) if buckets else None
+        self._lock = registry._lock
+        self._values = {}
+
+    def samples(self):
+        with self._lock:
+            return [[list(key), value if not isinstance(value, list) else list(value)]
+                    for key, value in self._values.items()]
+
+
+class Counter(Metric):
+    def inc(self, *labels, amount=1):
+        labels = _key(labels)
+        with self._lock:
+            self._values[labels] = self._values.get(labels, 0) + amount
+
+    def set(self, value, *labels):
+        """For totals that are counted elsewhere, such as IngestQueue.stats()."""
+        labels = _key(labels)
+        with self._lock:
+            self._values[labels] = value
+
+
+class Gauge(Metric):
+    def set(self, value, *labels):
+        labels = _key(labels)
+        with self._lock:
+            self._values[labels] = value
+
+
+class Histogram(Metric):
+    def observe(self, value, *labels):
+        # Per-bucket counts, then sum and count; made cumulative when rendered
+        labels = _key(labels)
+        with self._lock:
+            entry = self._values.get(labels)
+            if entry is None:
+                entry = self._values[labels] = [0] * len(self.buckets) + [0.0, 0]
+            for i, bound in enumerate(self.buckets):
+                if value <= bound:
+                    entry[i] += 1
+                    break
+            entry[-2] += value
+            entry[-1] += 1
+
+
+class Registry:
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._metrics = []
+        self._collectors = []
+
+    def _add(self, metric):
+        self._metrics.append(metric)
+        return metric
+
+    def counter(self, name, help, labels=()):
+        return self._add(Counter(self, 'counter', name, help, labels))
+
+    def gauge(self, name, help, labels=()):
+        return self._add(Gauge(self, 'gauge', name, help, labels))
+
+    def histogram(self, name, help, labels=(), buckets=LATENCY_BUCKETS):
+        return self._add(Histogram(self, 'histogram', name, help, labels, buckets))
+
+    def add_collector(self, collect):
+        """collect() is called before every snapshot to refresh values kept elsewhere."""
+        self._collectors.append(collect)
+
+    def families(self):
+        for collect in self._collectors:
+            try:
+                collect()
+            except Exception as e:
+                print(f"Metrics collector failed: {e}")
+        return [{'kind': m.kind, 'name': m.name, 'help': m.help, 'labels': m.labels,
+                 'buckets': m.buckets, 'samples': m.samples()} for m in self._metrics]
+
+    def dump(self, directory):
+        os.makedirs(directory, exist_ok=True)
+        path = os.path.join(directory, f'{os.getpid()}.json')
+        with open(path + '.tmp', 'w') as f:
+            json.dump(self.families(), f, separators=(',', ':'))
+        os.replace(path + '.tmp', path)
+
+
+# Metrics of this process; modules register theirs at import
+REGISTRY = Registry()
+
+
+def _alive(pid):
+    try:
+        os.kill(pid, 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+    return True
+
+
+def merge(directory):
+    """The families of every worker's snapshot, summed per name and labels."""
+    merged = {}
+    for name in os.listdir(directory):
+        pid, _, ext = name.partition('.')
+        if ext != 'json' or not pid.isdigit():
+            continue
+        try:
+            with open(os.path.join(directory, name)) as f:
+                families = json.load(f)
+        except (OSError, ValueError):
+            continue
+        alive = _alive(int(pid))
+        for family in families:
+            if family['kind'] == 'gauge' and not alive:
+                continue
+            target = merged.setdefault(family['name'], dict(family, samples={}))
+            for labels, value in family['samples']:
+                key = tuple(labels)
+                current = target['samples'].get(key)
+                if current is None:
+                    target['samples'][key] = value
+                elif isinstance(value, list):
+                    target['samples'][key] = [a + b for a, b in zip(current, value)]
+                else:
+                    target['samples'][key] = current + value
+    for family in merged.values():
+        family['samples'] = [[list(key), value] for key, value in family['samples'].items()]
+    return list(merged.values())
+
+
+def clear(directory):
+    """Forgets snapshots of a previous run; call before any worker starts."""
+    os.makedirs(directory, exist_ok=True)
+    for name in os.listdir(directory):
+        if name.endswith('.json') or name.endswith('.tmp'):
+            os.remove(os.path.join(directory, name))
+
+
+def _escape(value):
+    return str(value).replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+
+
+def _label_str(names, values, extra=()):
+    pairs = list(zip(names, values)) + list(extra)
+    if not pairs:
+        return ''
+    return '{' + ','.join(f'{name}="{_escape(value)}"' for name, value in pairs) + '}'
+
+
+def _number(value):
+    if isinstance(value, float):
+        if math.isinf(value):
+            return '+Inf' if value > 0 else '-Inf'
+        if value.is_integer():
+            return str(int(value))
+    return repr(value)
+
+
+def render(families):
+    out = []
+    for family in sorted(families, key=lambda f: f['name']):
+        name = family['name']
+        out.append(f"# HELP {name} {family['help']}")
+        out.append(f"# TYPE {name} {family['kind']}")
+        for labels, value in sorted(family['samples'], key=lambda sample: sample[0]):
+            if family['kind'] != 'histogram':
+                out.append(f"{name}{_label_str(family['labels'], labels)} {_number(value)}")
+                continue
+            cumulative = 0
+            for bound, count in zip(family['buckets'], value):
+                cumulative += count
+                le = _label_str(family['labels'], labels, [('le', _number(float(bound)))])
+                out.append(f"{name}_bucket{le} {cumulative}")
+            le = _label_str(family['labels'], labels, [('le', '+Inf')])
+            out.append(f"{name}_bucket{le} {value[-1]}")
+            out.append(f"{name}_sum{_label_str(family['labels'], labels)} {_number(value[-2])}")
+            out.append(f"{name}_count{_label_str(family['labels'], labels)} {value[-1]}")
+    return '\n'.join(out) + '\n'
+
+
+class SnapshotWriter(threading.Thread):
+    """Dumps a registry every interval seconds so other workers can serve it."""
+
+    def __init__(self, registry, directory, interval=5.0):
+        super().__init__(name='metrics-snapshot', daemon=True)
+        self.registry = registry
+        self.directory = directory
+        self.interval = interval
+        self._stop_event = threading.Event()
+
+    def run(self):
+        while not self._stop_event.wait(self.interval):
+            try:
+                self.registry.dump(self.directory)
+            except Exception as e:
+                print(f"Metrics snapshot failed: {e}")
+
+    def stop(self):
+        self._stop_event.set()
+        self.join(self.interval * 2)
+        self.registry.dump(self.directory)
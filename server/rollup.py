@@ -0,0 +1,180 @@
+import time
+
+from influxdb_client import Point, WritePrecision
+
+import archive
+import storage
+
+TIER_NAMES = {0: 'raw', 60: '1m', 3600: '1h', 86400: '1d'}
+
+# How long each tier is kept, in seconds; None keeps it forever
+RETENTION = {
+    0: 30 * 86400,
+    60: 90 * 86400,
+    3600: 3 * 365 * 86400,
+    86400: None,
+}
+
+# Most raw rows /series returns; wider or denser ranges come from a rollup tier.
+# Upload rates vary (10 s on short sleeps, 5 s continuous), so rows are counted
+RAW_ROW_LIMIT = 10000
+
+# Only the coarse tiers go to InfluxDB; the raw bucket already has full resolution
+EXPORT_TIERS = (3600, 86400)
+EXPORT_MEASUREMENT = 'sensor_rollup'
+
+UPSERT_SQL = f'''
+    INSERT INTO rollup (tier, device, ts, n, {', '.join(storage.ROLLUP_VALUES)}, dirty)
+    VALUES (?, ?, ?, ?, {', '.join('?' for _ in storage.ROLLUP_VALUES)}, 1)
+    ON CONFLICT (tier, device, ts) DO UPDATE SET
+        n = n + excluded.n,
+        {', '.join(f'{c}_min = MIN({c}_min, excluded.{c}_min), '
+                   f'{c}_max = MAX({c}_max, excluded.{c}_max), '
+                   f'{c}_sum = {c}_sum + excluded.{c}_sum' for c in storage.CHANNELS)},
+        dirty = 1
+'''
+
+
+def apply(conn, rows):
+    """Folds raw rows (storage.INSERT_SQL order) into every tier.
+
+    Rows are pre-aggregated per bucket so a batch costs one upsert per bucket
+    it touches, not one per row and tier. Runs inside the caller's transaction.
+    """
+    buckets = {}
+    for row in rows:
+        device, ts, values = row[0], row[1], row[2:2 + len(storage.CHANNELS)]
+        for tier in storage.TIERS:
+            key = (tier, device, ts // tier * tier)
+            acc = buckets.get(key)
+            if acc is None:
+                buckets[key] = acc = [0] + [v for value in values for v in (value, value, 0.0)]
+            acc[0] += 1
+            for i, value in enumerate(values):
+                base = 1 + 3 * i
+                acc[base] = min(acc[base], value)
+                acc[base + 1] = max(acc[base + 1], value)
+                acc[base + 2] += value
+    conn.executemany(UPSERT_SQL, [key + tuple(acc) for key, acc in buckets.items()])
+
+
+def prune(conn, now):
+    """Drops raw rows and rollup buckets past their tier's retention."""
+    deleted = 0
+    if RETENTION[0]:
+        deleted += conn.execute('DELETE FROM sensor_data WHERE ts < ?', (now - RETENTION[0],)).rowcount
+    for tier in storage.TIERS:
+        if RETENTION[tier]:
+            deleted += conn.execute('DELETE FROM rollup WHERE tier = ? AND ts < ?',
+                                    (tier, now - RETENTION[tier])).rowcount
+    return deleted
+
+
+def export(conn, influx):
+    """Writes changed hour and day buckets to InfluxDB.
+
+    A bucket is rewritten whole each time it changes; InfluxDB replaces the
+    point with the same series and time, so late samples just correct it.
+    Every worker's ingest writer upserts into rollup, so reading the dirty
+    buckets and clearing them happen in one write transaction; otherwise a
+    bucket changed in between would be marked clean without being exported.
+    """
+    select = f'''SELECT tier, device, ts, n, {', '.join(storage.ROLLUP_VALUES)} FROM rollup
+                 WHERE dirty AND tier IN ({', '.join(str(t) for t in EXPORT_TIERS)})'''
+    conn.execute('BEGIN IMMEDIATE')
+    with conn:
+        rows = conn.execute(select).fetchall()
+        if not rows:
+            return 0
+
+        points = []
+        for row in rows:
+            r = row_dict(row)
+            point = (
+                Point(EXPORT_MEASUREMENT)
+                .tag("tier", r['tier'])
+                .field("samples", r['n'])
+                .time(r['ts'], WritePrecision.S)
+            )
+            if r['device']:
+                point.tag("device", r['device'])
+            for channel in storage.CHANNELS:
+                for agg in ('min', 'max', 'mean'):
+                    point.field(f"{channel}_{agg}", float(r[f'{channel}_{agg}']))
+            points.append(point)
+        # Only queues; once queued, InfluxWriter retries or spools them, so they are clean here
+        influx.write(points)
+        conn.executemany('UPDATE rollup SET dirty = 0 WHERE tier = ? AND device = ? AND ts = ?',
+                         [row[:3] for row in rows])
+    return len(rows)
+
+
+def maintain(conn, influx, archive_dir=None):
+    now = int(time.time())
+    # Raw rows are archived before retention can delete them
+    archived = archive.archive_closed(conn, archive_dir, now) if archive_dir else 0
+    with conn:
+        deleted = prune(conn, now)
+    exported = export(conn, influx)
+    print(f"Rollup maintenance: archived {archived} days, pruned {deleted} rows, exported {exported} buckets")
+
+
+def raw_fits(conn, start, end, device, max_points):
+    """Whether raw rows in [start, end) number at most max_points per device and RAW_ROW_LIMIT in all."""
+    where = 'ts >= ? AND ts < ?' + ('' if device is None else ' AND device = ?')
+    params = (start, end) + (() if device is None else (device,))
+    # Stops counting past the limit, so a huge range costs no more than a small one
+    total = conn.execute(f'SELECT COUNT(*) FROM (SELECT 1 FROM sensor_data WHERE {where} LIMIT ?)',
+                         params + (RAW_ROW_LIMIT + 1,)).fetchone()[0]
+    if total > RAW_ROW_LIMIT:
+        return False
+    if device is not None:
+        return total <= max_points
+    densest = conn.execute(f'SELECT MAX(n) FROM (SELECT COUNT(*) AS n FROM sensor_data WHERE {where} '
+                           'GROUP BY device)', params).fetchone()[0]
+    return (densest or 0) <= max_points
+
+
+def choose_tier(conn, start, end, device, max_points, now):
+    """The finest tier that still has data at start and returns at most max_points per device."""
+    for tier in (0,) + storage.TIERS:
+        retention = RETENTION[tier]
+        if retention and start < now - retention:
+            continue
+        if tier == 0:
+            if raw_fits(conn, start, end, device, max_points):
+                return tier
+        elif (end - start) / tier <= max_points:
+            return tier
+    return storage.TIERS[-1]
+
+
+def row_dict(row):
+    tier, device, ts, n, *values = row
+    out = {'tier': TIER_NAMES[tier], 'device': device, 'ts': ts, 'n': n}
+    for i, channel in enumerate(storage.CHANNELS):
+        lo, hi, total = values[3 * i:3 * i + 3]
+        out[f'{channel}_min'] = lo
+        out[f'{channel}_max'] = hi
+        out[f'{channel}_mean'] = total / n if n and total is not None else None
+    return out
+
+
+def query(conn, start, end, device=None, max_points=1000, now=None):
+    """Rows for [start, end) from the tier choose_tier() picks, oldest first."""
+    tier = choose_tier(conn, start, end, device, max_points, now or int(time.time()))
+    if tier == 0:
+        rows = storage.query_range(conn, start, end, device, RAW_ROW_LIMIT + 1)
+        if len(rows) <= RAW_ROW_LIMIT:
+            return 'raw', rows
+        # Rows arrived since they were counted; a truncated chart would hide the newest
+        tier = storage.TIERS[0]
+
+    select = f'SELECT tier, device, ts, n, {", ".join(storage.ROLLUP_VALUES)} FROM rollup'
+    if device is None:
+        rows = conn.execute(f'{select} WHERE tier = ? AND ts >= ? AND ts < ? ORDER BY ts, device',
+                            (tier, start - start % tier, end))
+    else:
+        rows = conn.execute(f'{select} WHERE tier = ? AND device = ? AND ts >= ? AND ts < ? ORDER BY ts',
+                            (tier, device, start - start % tier, end))
+    return TIER_NAMES[tier], [row_dict(row) for row in rows]
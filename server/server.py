@@ -1,44 +1,297 @@
+import collections
 import json
-from flask import Flask, make_response, request, jsonify, send_from_directory
-from influxdb_client import InfluxDBClient, Point, WriteOptions
+import math
+from flask import Flask, g, make_response, request, jsonify
+from influxdb_client import InfluxDBClient, Point, WritePrecision
 from influx_token import INFLUX_TOKEN
-import sqlite3
-from datetime import datetime
+from datetime import datetime, timezone
 import os
+import re
+import struct
+import atexit
+import signal
+import sys
+import threading
+import time
+import zlib
+import firmware
+import metrics
+import rollup
+import storage
+from cache import ReadingCache, TableFollower
+from ingest import IngestQueue, IngestFull
+from influx_writer import InfluxWriter
 
-INFLUX_URL = "http://localhost:8086"
+# Overridable so load tests can point the server at a stand-in (see loadgen.py)
+INFLUX_URL = os.environ.get("INFLUX_URL", "http://localhost:8086")
 TOKEN = INFLUX_TOKEN
 INFLUX_ORG = "vhpl"
 INFLUX_BUCKET = "sensor"
 
-influx_client = InfluxDBClient(
-    url=INFLUX_URL,
-    token=TOKEN,
-    org=INFLUX_ORG)
-write_api = influx_client.write_api(write_options=WriteOptions(batch_size=1))
-
 app = Flask(__name__)
 DB_FILE = 'sensor_data.db'
+FIRMWARE_DIR = os.path.join(os.path.dirname(__file__), 'firmware')
+DEVICE_CONFIG_FILE = os.path.join(os.path.dirname(__file__), 'device_config.json')
+ARCHIVE_DIR = os.path.join(os.path.dirname(__file__), 'archive')
+# Line protocol waiting for InfluxDB to come back, shared by all workers
+INFLUX_SPOOL_DIR = os.path.join(os.path.dirname(__file__), 'influx_spool')
+# Per-worker metric snapshots that /metrics adds up (see metrics.py)
+METRICS_DIR = os.path.join(os.path.dirname(__file__), 'metrics_snapshots')
+
+# Pushed to every device in the /sensor response unless device_config.json overrides it
+DEFAULT_DEVICE_CONFIG = {
+    'sleep': 300,
+    'heatr_temp': 320,
+    'heatr_dur': 150,
+}
+
+STATS_CHANNELS = ('temperature', 'humidity', 'pressure', 'gas_resistance')
+STATS_FIELDS = ('min', 'max', 'mean', 'stddev')
+
+# Radio and network health block from esp32/main/net_health.c; "fail" is its only string
+HEALTH_MEASUREMENT = 'device_health'
+HEALTH_FIELDS = ('rssi', 'ch', 'conn_ms', 'dhcp_ms', 'retries', 'tls_ms', 'status', 'fails',
+                 'heap', 'heap_min', 'reset')
+
+# Flash journal record from esp32/main/journal.h; the CRC32 covers the first 28 bytes
+JOURNAL_RECORD_FMT = '<IIfffIHBBI'
+JOURNAL_RECORD_SIZE = struct.calcsize(JOURNAL_RECORD_FMT)
+# Devices send 0 until their first SNTP sync; anything older than this is not a real date
+MIN_VALID_TIMESTAMP = 1577836800
+# Nodes identify themselves by their station MAC in hex; older firmware sends nothing
+DEVICE_ID_RE = re.compile(r'[0-9A-Za-z_-]{1,32}')
+# Firmware versions name files under firmware/, so no separators or leading dots
+VERSION_RE = re.compile(r'[0-9A-Za-z_-][0-9A-Za-z._-]{0,31}')
+
+HTTP_REQUESTS = metrics.REGISTRY.counter(
+    'sensor_http_requests_total', 'HTTP requests by route, method and status', ('route', 'method', 'status'))
+HTTP_LATENCY = metrics.REGISTRY.histogram(
+    'sensor_http_request_duration_seconds', 'Time to produce a response', ('route', 'method'))
+HTTP_REQUEST_SIZE = metrics.REGISTRY.histogram(
+    'sensor_http_request_size_bytes', 'Request body sizes', ('route',), metrics.SIZE_BUCKETS)
+INGEST_ROWS = metrics.REGISTRY.counter('sensor_ingest_rows_total', 'Rows written to SQLite')
+INGEST_REJECTED = metrics.REGISTRY.counter('sensor_ingest_rejected_total', 'Uploads refused with 503, queue full')
+INGEST_ERRORS = metrics.REGISTRY.counter('sensor_ingest_write_errors_total', 'Ingest batches that failed')
+INGEST_DEPTH = metrics.REGISTRY.gauge('sensor_ingest_queue_depth', 'Items waiting in the ingest queues')
+INFLUX_LINES = metrics.REGISTRY.counter('sensor_influx_lines_written_total', 'Lines accepted by InfluxDB')
+INFLUX_ERRORS = metrics.REGISTRY.counter('sensor_influx_write_errors_total', 'Failed InfluxDB write requests')
+INFLUX_DROPPED = metrics.REGISTRY.counter('sensor_influx_lines_dropped_total', 'Lines rejected by InfluxDB or lost')
+INFLUX_SPILLED = metrics.REGISTRY.counter('sensor_influx_lines_spooled_total', 'Lines written to the spool')
+INFLUX_REPLAYED = metrics.REGISTRY.counter('sensor_influx_lines_replayed_total', 'Spooled lines sent later')
+INFLUX_BUFFERED = metrics.REGISTRY.gauge('sensor_influx_buffered_lines', 'Lines waiting in memory for InfluxDB')
+CACHE_LOOKUPS = metrics.REGISTRY.counter('sensor_cache_lookups_total', 'Reading cache lookups', ('result',))
+
+# Per-process services, created by start_services(). Threads and sockets do not
+# survive fork(), so under a pre-forking server every worker opens its own.
+influx_client = None
+influx_writer = None
+db_pool = None
+reading_cache = None
+follower = None
+ingest = None
+rollout_slots = None
+snapshotter = None
+delta_builder = None
+_services_pid = None
+_services_lock = threading.Lock()
+
+def start_services():
+    global influx_client, influx_writer, db_pool, reading_cache, follower, ingest, rollout_slots, snapshotter, \
+        delta_builder, _services_pid
+    with _services_lock:
+        if _services_pid == os.getpid():
+            return
+
+        # Creates the table or migrates an older layout before anything else touches it
+        storage.init_db(DB_FILE)
+        db_pool = storage.ConnectionPool(DB_FILE)
+        rollout_slots = firmware.RolloutSlots(db_pool)
+
+        influx_client = InfluxDBClient(url=INFLUX_URL, token=TOKEN, org=INFLUX_ORG)
+        influx_writer = InfluxWriter(influx_client, INFLUX_BUCKET, INFLUX_SPOOL_DIR)
+        influx_writer.start()
+
+        # /latest and /recent are answered from here; seeded once from SQLite so a
+        # restart does not forget the fleet, then fed with rows other workers store
+        reading_cache = ReadingCache()
+        with db_pool.connection() as conn:
+            last_id = storage.max_id(conn)
+            reading_cache.warm(storage.recent_per_device(conn, reading_cache.window))
+        follower = TableFollower(reading_cache, db_pool, last_id)
+        follower.start()
+
+        # Storage writes happen on a background thread so a device's POST returns
+        # without waiting for SQLite commits or InfluxDB
+        ingest = IngestQueue(DB_FILE, influx_writer, archive_dir=ARCHIVE_DIR)
+        ingest.start()
+
+        snapshotter = metrics.SnapshotWriter(metrics.REGISTRY, METRICS_DIR)
+        snapshotter.start()
+
+        # Patches for every kept release are built before nodes ask for them;
+        # one worker builds each, the others find it done
+        delta_builder = firmware.DeltaBuilder(os.path.join(FIRMWARE_DIR, 'deltas'))
+        delta_builder.start()
+        queue_release_deltas()
+
+        _services_pid = os.getpid()
+        atexit.register(stop_services)
+
+def stop_services(timeout=20.0):
+    """Drains the ingest queue, then flushes or spools InfluxDB points and closes the database."""
+    global _services_pid
+    with _services_lock:
+        if _services_pid != os.getpid():
+            return
+        _services_pid = None
+        ingest.stop(timeout)
+        follower.stop()
+        delta_builder.stop()
+        influx_writer.close()
+        influx_client.close()
+        # Last snapshot, so the final counts outlive the worker
+        snapshotter.stop()
+        db_pool.close()
+        print(f"Worker {os.getpid()} stopped, {ingest.stats()['depth']} items left unwritten")
+
+@app.before_request
+def ensure_services():
+    start_services()
+    g.request_start = time.perf_counter()
+
+@app.after_request
+def record_request(resp):
+    # The rule rather than the path, so /latest/<device_id> is one series
+    route = request.url_rule.rule if request.url_rule else 'unmatched'
+    HTTP_REQUESTS.inc(route, request.method, resp.status_code)
+    if 'request_start' in g:
+        HTTP_LATENCY.observe(time.perf_counter() - g.request_start, route, request.method)
+    if request.content_length:
+        HTTP_REQUEST_SIZE.observe(request.content_length, route)
+    return resp
 
-def init_db():
-    if not os.path.exists(DB_FILE):
-        conn = sqlite3.connect(DB_FILE)
-        c = conn.cursor()
-        c.execute('''
-            CREATE TABLE sensor_data (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                temperature REAL,
-                humidity REAL,
-                pressure REAL,
-                gas_resistance REAL,
-                timestamp TEXT
-            )
-        ''')
-        conn.commit()
-        conn.close()
-        print(f"Database {DB_FILE} created and initialized.")
-
-init_db()
+def collect_service_metrics():
+    stats = ingest.stats()
+    INGEST_ROWS.set(stats['written'])
+    INGEST_REJECTED.set(stats['rejected'])
+    INGEST_ERRORS.set(stats['write_errors'])
+    INGEST_DEPTH.set(stats['depth'])
+    stats = influx_writer.stats()
+    INFLUX_LINES.set(stats['written'])
+    INFLUX_ERRORS.set(stats['write_errors'])
+    INFLUX_DROPPED.set(stats['dropped'])
+    INFLUX_SPILLED.set(stats['spilled'])
+    INFLUX_REPLAYED.set(stats['replayed'])
+    INFLUX_BUFFERED.set(stats['buffered'])
+    stats = reading_cache.stats()
+    CACHE_LOOKUPS.set(stats['hits'], 'hit')
+    CACHE_LOOKUPS.set(stats['misses'], 'miss')
+
+metrics.REGISTRY.add_collector(collect_service_metrics)
+
+def fleet_metrics():
+    """State every worker sees the same way, so it is computed per scrape, not summed."""
+    fleet = metrics.Registry()
+    last_seen = fleet.gauge('sensor_device_last_seen_age_seconds',
+                            'Seconds since the acquisition time of the newest reading of each node', ('device',))
+    by_fw = fleet.gauge('sensor_devices_by_firmware', 'Nodes by the firmware of their newest reading', ('fw',))
+    now = time.time()
+    versions = collections.Counter()
+    for device, reading in reading_cache.devices().items():
+        last_seen.set(round(now - reading['ts']), device)
+        versions[reading.get('fw') or 'unknown'] += 1
+    for fw, count in versions.items():
+        by_fw.set(count, fw)
+
+    spool = influx_writer.stats()
+    fleet.gauge('sensor_influx_spool_bytes', 'Size of the InfluxDB spool').set(spool['spool_bytes'])
+    fleet.gauge('sensor_influx_spool_files', 'Files in the InfluxDB spool').set(spool['spool_files'])
+
+    version_data = load_json_cached(os.path.join(FIRMWARE_DIR, 'version.json'))
+    if version_data and 'version' in version_data:
+        fleet.gauge('sensor_firmware_rollout_slots', 'Nodes holding a download slot for the target version',
+                    ('version',)).set(rollout_slots.active(version_data['version']), version_data['version'])
+    return fleet.families()
+
+def busy_response():
+    resp = jsonify({'status': 'busy'})
+    resp.headers['Retry-After'] = '30'
+    return resp, 503
+
+_json_cache = {}
+
+def load_json_cached(path):
+    try:
+        mtime = os.stat(path).st_mtime_ns
+    except FileNotFoundError:
+        return None
+    cached = _json_cache.get(path)
+    if cached is None or cached[0] != mtime:
+        with open(path, 'r') as f:
+            cached = (mtime, json.load(f))
+        _json_cache[path] = cached
+    return cached[1]
+
+# Images are served from memory; read and hashed once per file change
+firmware_store = firmware.FirmwareStore()
+
+def control_block(device='', running=''):
+    ctl = dict(DEFAULT_DEVICE_CONFIG)
+    ctl.update(load_json_cached(DEVICE_CONFIG_FILE) or {})
+
+    version_data = load_json_cached(os.path.join(FIRMWARE_DIR, 'version.json'))
+    image = firmware_store.get(os.path.join(FIRMWARE_DIR, 'firmware.bin'))
+    if version_data and 'version' in version_data and image:
+        target = version_data['version']
+        # Nodes that say who they are wait for a rollout slot before hearing about
+        # an update; the rest keep the old behaviour
+        rollout = version_data.get('rollout', {})
+        if not device or rollout_slots.acquire(device, running, target, rollout.get('max_concurrent'),
+                                               rollout.get('lease')):
+            ctl['fw'] = target
+            ctl['fw_crc'] = f"{image.crc32:08x}"
+    return ctl
+
+def sample_time(ts):
+    """Acquisition time from the device, or arrival time if its clock was not synced."""
+    return ts if ts >= MIN_VALID_TIMESTAMP else int(time.time())
+
+def channel_value(data, name):
+    """A channel as float; strings, nulls and non-finite numbers would poison the rollup sums."""
+    value = data.get(name)
+    if isinstance(value, bool) or not isinstance(value, (int, float)) or not math.isfinite(value):
+        raise ValueError(f"{name} must be a number, got {value!r}")
+    return float(value)
+
+def device_identity(device, fw):
+    device = str(device or '')
+    fw = str(fw or '')[:32]
+    if device and not DEVICE_ID_RE.fullmatch(device):
+        raise ValueError(f"invalid device id {device!r}")
+    return device, fw
+
+def sensor_point(device, fw, measurement="sensor"):
+    point = Point(measurement)
+    if device:
+        point.tag("device", device)
+    if fw:
+        point.tag("fw", fw)
+    return point
+
+def health_point(device, fw, health):
+    """The node's health block as its own series, stamped on arrival: it describes the upload."""
+    point = sensor_point(device, fw, HEALTH_MEASUREMENT).time(int(time.time()), WritePrecision.S)
+    for key in HEALTH_FIELDS:
+        if key in health:
+            point.field(key, int(health[key]))
+    if health.get('fail'):
+        point.field('fail', str(health['fail'])[:32])
+    return point
+
+def row_json(row):
+    row = dict(row)
+    row['timestamp'] = datetime.fromtimestamp(row['ts'], timezone.utc).isoformat()
+    return row
 
 @app.route('/sensor', methods=['POST'])
 def sensor_data():
@@ -47,60 +300,284 @@ def sensor_data():
         if not data or 'temperature' not in data:
             return jsonify({'error': 'Invalid data'}), 400
         
-        temperature = data['temperature']
-        humidity = data['humidity']
-        pressure = data['pressure']
-        gas_resistance = data['gas_resistance']
-        timestamp = datetime.now().isoformat()
-
-        conn = sqlite3.connect(DB_FILE)
-        c = conn.cursor()
-        c.execute('INSERT INTO sensor_data (temperature, humidity, pressure, gas_resistance, timestamp) VALUES (?, ?, ?, ?, ?)', (temperature, humidity, pressure, gas_resistance, timestamp))
-        conn.commit()
-        conn.close()
-
-        print(f"Inserted data: {data} at {timestamp}")
+        temperature = channel_value(data, 'temperature')
+        humidity = channel_value(data, 'humidity')
+        pressure = channel_value(data, 'pressure')
+        gas_resistance = channel_value(data, 'gas_resistance')
+        device, fw = device_identity(data.get('id'), data.get('fw'))
+        # Devices stamp readings at acquisition once their clock is synced
+        ts = int(data.get('ts', 0))
+        timestamp = sample_time(ts)
 
         point = (
-            Point("sensor")
+            sensor_point(device, fw)
             .field("temperature", temperature)
             .field("humidity", humidity)
             .field("pressure", pressure)
             .field("gas_resistance", gas_resistance)
+            # Stamped here, as the write to InfluxDB may be retried much later
+            .time(timestamp, WritePrecision.S)
         )
-        write_api.write(bucket=INFLUX_BUCKET, record=point)
-        print(f"Data written to InfluxDB: {data}")
+        reading = {'device': device, 'fw': fw, 'ts': timestamp, 'temperature': temperature,
+                   'humidity': humidity, 'pressure': pressure, 'gas_resistance': gas_resistance}
+        if 'iaq' in data:
+            reading['iaq'] = float(data['iaq'])
+            reading['iaq_accuracy'] = int(data.get('iaq_acc', 0))
+            point.field("iaq", reading['iaq']).field("iaq_accuracy", reading['iaq_accuracy'])
+        # Heater profile scan: one gas resistance per profile step
+        for i, resistance in enumerate(data.get('gas_fp') or []):
+            point.field(f"gas_fp_{i}", int(resistance))
+        # Continuous-sampling nodes send per-interval [min, max, mean, stddev] per channel
+        stats = data.get('stats')
+        if stats:
+            point.field("samples", int(stats.get('n', 0)))
+            for channel in STATS_CHANNELS:
+                if channel in stats:
+                    for suffix, value in zip(STATS_FIELDS, stats[channel]):
+                        point.field(f"{channel}_{suffix}", float(value))
+        points = [point]
+        health = data.get('net')
+        if isinstance(health, dict):
+            points.append(health_point(device, fw, health))
+        ingest.submit([(device, timestamp, temperature, humidity, pressure, gas_resistance, fw)], points)
+        reading_cache.add(reading)
+        print(f"Queued data from {device or 'unknown node'}: {data} at {timestamp}")
 
-        return jsonify({'status': 'ok'}), 200
+        return jsonify({'status': 'ok', 'ctl': control_block(device, fw)}), 200
+    except IngestFull:
+        print("Ingest queue full, asking device to retry later")
+        return busy_response()
     except Exception as e:
         print("Failed to parse JSON:", e)
         return jsonify({"status": "error", "message": str(e)}), 400
 
+@app.route('/sensor/batch', methods=['POST'])
+def sensor_batch():
+    """Bulk drain of samples the device journaled while offline.
+
+    Replies with the highest sequence number received so the device can
+    drop everything up to it, including records that failed their CRC.
+    """
+    body = request.get_data()
+    if not body or len(body) % JOURNAL_RECORD_SIZE:
+        return jsonify({'error': 'Invalid batch'}), 400
+    try:
+        device, fw = device_identity(request.headers.get('X-Device-Id'),
+                                     request.headers.get('X-Firmware-Version'))
+    except ValueError as e:
+        return jsonify({'error': str(e)}), 400
+
+    rows = []
+    points = []
+    readings = []
+    ack = 0
+    for off in range(0, len(body), JOURNAL_RECORD_SIZE):
+        raw = body[off:off + JOURNAL_RECORD_SIZE]
+        seq, ts, temperature, humidity, pressure, gas_resistance, iaq_x10, iaq_acc, _, crc = \
+            struct.unpack(JOURNAL_RECORD_FMT, raw)
+        ack = max(ack, seq)
+        if zlib.crc32(raw[:JOURNAL_RECORD_SIZE - 4]) != crc:
+            print(f"Dropping journal record {seq}: bad CRC")
+            continue
+
+        timestamp = sample_time(ts)
+        rows.append((device, timestamp, temperature, humidity, pressure, gas_resistance, fw))
+        readings.append({'device': device, 'fw': fw, 'ts': timestamp, 'temperature': temperature,
+                         'humidity': humidity, 'pressure': pressure, 'gas_resistance': gas_resistance,
+                         'iaq': iaq_x10 / 10.0, 'iaq_accuracy': iaq_acc})
+        point = (
+            sensor_point(device, fw)
+            .field("temperature", temperature)
+            .field("humidity", humidity)
+            .field("pressure", pressure)
+            .field("gas_resistance", gas_resistance)
+            .field("iaq", iaq_x10 / 10.0)
+            .field("iaq_accuracy", iaq_acc)
+            .field("journal_seq", seq)
+            .time(timestamp, WritePrecision.S)
+        )
+        points.append(point)
+
+    # The device erases what we acknowledge, so this one waits until the rows are stored
+    try:
+        stored = ingest.submit(rows, points, wait=True)
+    except IngestFull:
+        return busy_response()
+    if not stored:
+        return jsonify({'status': 'error', 'message': 'storage write failed'}), 500
+    for reading in readings:
+        reading_cache.add(reading)
+
+    print(f"Drained {len(rows)} journaled samples up to seq {ack}")
+    return jsonify({'status': 'ok', 'ack': ack, 'stored': len(rows)}), 200
+
+@app.route('/ingest/stats', methods=['GET'])
+def ingest_stats():
+    return jsonify(dict(ingest.stats(), influx=influx_writer.stats()))
+
+@app.route('/metrics', methods=['GET'])
+def metrics_endpoint():
+    """Prometheus scrape target covering all workers."""
+    metrics.REGISTRY.dump(METRICS_DIR)
+    resp = make_response(metrics.render(metrics.merge(METRICS_DIR) + fleet_metrics()))
+    resp.headers['Content-Type'] = metrics.CONTENT_TYPE
+    return resp
+
 @app.route('/latest', methods=['GET'])
 def latest():
-    conn = sqlite3.connect(DB_FILE)
-    c = conn.cursor()
-    c.execute('SELECT * FROM sensor_data ORDER BY id DESC LIMIT 1')
-    row = c.fetchone()
-    conn.close()
+    row = reading_cache.newest()
     if row:
-        return jsonify({'row_id': row[0], 'temperature': row[1], 'humidity': row[2], 'pressure': row[3], 'gas_resistance': row[4], 'timestamp': row[5]})
+        return jsonify(row_json(row))
     else:
         return jsonify({'error': 'No data found'}), 404
+
+@app.route('/latest/<device_id>', methods=['GET'])
+def latest_device(device_id):
+    row = reading_cache.get(device_id)
+    if row:
+        return jsonify(row_json(row))
+    else:
+        return jsonify({'error': 'No data found for this device'}), 404
+
+@app.route('/devices', methods=['GET'])
+def devices():
+    return jsonify({device: {'fw': row.get('fw', ''), 'last_seen': row['ts']}
+                    for device, row in reading_cache.devices().items()})
+
+@app.route('/series', methods=['GET'])
+def series():
+    """A time range from the coarsest-needed tier: raw rows or 1m/1h/1d min/max/mean buckets."""
+    try:
+        start = int(request.args['start'])
+        end = int(request.args.get('end', time.time() + 1))
+        points = min(max(int(request.args.get('points', 1000)), 1), 10000)
+    except (KeyError, ValueError):
+        return jsonify({'error': 'start (and optional end, points) must be integers'}), 400
+    with db_pool.connection() as conn:
+        tier, rows = rollup.query(conn, start, end, request.args.get('device'), points)
+    if tier == 'raw':
+        rows = [row_json(row) for row in rows]
+    return jsonify({'tier': tier, 'rows': rows})
+
+@app.route('/recent', methods=['GET'])
+def recent():
+    """The newest n readings (default 60), oldest first, of one device or the whole fleet."""
+    try:
+        n = min(max(int(request.args.get('n', 60)), 1), 10000)
+    except ValueError:
+        return jsonify({'error': 'n must be an integer'}), 400
+    device = request.args.get('device')
+    rows = reading_cache.recent(n, device)
+    if rows is None:
+        # Deeper than the in-memory window
+        with db_pool.connection() as conn:
+            rows = storage.recent(conn, n, device)
+    return jsonify([row_json(row) for row in rows])
+
+@app.route('/cache/stats', methods=['GET'])
+def cache_stats():
+    return jsonify(reading_cache.stats())
+
+@app.route('/range', methods=['GET'])
+def range_query():
+    """Rows between two Unix times (end exclusive), optionally for one device."""
+    try:
+        start = int(request.args['start'])
+        end = int(request.args.get('end', time.time() + 1))
+        limit = min(max(int(request.args.get('limit', 1000)), 1), 10000)
+    except (KeyError, ValueError):
+        return jsonify({'error': 'start (and optional end, limit) must be Unix seconds'}), 400
+    with db_pool.connection() as conn:
+        rows = storage.query_range(conn, start, end, request.args.get('device'), limit + 1)
+    resp = jsonify([row_json(row) for row in rows[:limit]])
+    # Oldest first, so the cut-off rows are the newest; page on from the last ts
+    if len(rows) > limit:
+        resp.headers['X-Truncated'] = 'true'
+    return resp
     
 @app.route('/firmware/latest', methods=['GET'])
 def firmware_latest():
-    firmware_dir = os.path.join(os.path.dirname(__file__), 'firmware')
-    filename = 'firmware.bin'
-    return send_from_directory(firmware_dir, filename, as_attachment=True)
+    image = firmware_store.get(os.path.join(FIRMWARE_DIR, 'firmware.bin'))
+    if image is None:
+        return jsonify({'error': 'No firmware image'}), 404
+    # Range/If-Range answers 206 with just the requested slice, which the device's
+    # resumable download relies on
+    return firmware.serve(image)
+
+@app.route('/firmware/blob/<sha256>', methods=['GET'])
+def firmware_blob(sha256):
+    """Any image or delta currently held, by SHA-256; safe for proxies to cache forever."""
+    artifact = firmware_store.by_sha256(sha256.lower())
+    if artifact is None:
+        return jsonify({'error': 'Unknown artifact'}), 404
+    return firmware.serve(artifact, immutable=True)
+
+@app.route('/firmware/rollout', methods=['GET'])
+def firmware_rollout():
+    version_data = load_json_cached(os.path.join(FIRMWARE_DIR, 'version.json')) or {}
+    target = version_data.get('version')
+    rollout = version_data.get('rollout', {})
+    return jsonify({
+        'version': target,
+        'active': rollout_slots.active(target) if target else 0,
+        'max_concurrent': rollout.get('max_concurrent', rollout_slots.max_concurrent),
+        'lease': rollout.get('lease', rollout_slots.lease),
+    })
+
+def queue_release_deltas():
+    target_file = os.path.join(FIRMWARE_DIR, 'firmware.bin')
+    releases_dir = os.path.join(FIRMWARE_DIR, 'releases')
+    if not os.path.exists(target_file) or not os.path.isdir(releases_dir):
+        return
+    for name in sorted(os.listdir(releases_dir)):
+        if name.endswith('.bin'):
+            delta_builder.submit(os.path.join(releases_dir, name), target_file)
+
+def valid_version(version):
+    return bool(VERSION_RE.fullmatch(version)) and '..' not in version
+
+@app.route('/firmware/delta', methods=['GET'])
+def firmware_delta():
+    from_version = request.args.get('from', '')
+    if not valid_version(from_version):
+        return jsonify({'error': 'Invalid version'}), 400
+    version_data = load_json_cached(os.path.join(FIRMWARE_DIR, 'version.json'))
+    # Images of previously released builds are kept as releases/<version>.bin
+    base_file = os.path.join(FIRMWARE_DIR, 'releases', from_version + '.bin')
+    if not os.path.exists(base_file) or version_data is None:
+        return jsonify({'error': 'No delta base for this version'}), 404
+
+    to_version = str(version_data.get('version', ''))
+    if to_version == from_version:
+        return jsonify({'error': 'Already up to date'}), 404
+    if not valid_version(to_version):
+        print(f"version.json names an unusable version {to_version!r}, not building deltas")
+        return jsonify({'error': 'No delta for the current release'}), 404
+
+    target_file = os.path.join(FIRMWARE_DIR, 'firmware.bin')
+    base = firmware_store.get(base_file)
+    target = firmware_store.get(target_file)
+    if base is None or target is None:
+        return jsonify({'error': 'No delta base for this version'}), 404
+    delta_file = delta_builder.path(base.sha256, target.sha256)
+    delta = firmware_store.get(delta_file)
+    if delta is not None:
+        return firmware.serve(delta)
+    if delta_builder.unusable(base.sha256, target.sha256):
+        return jsonify({'error': 'No useful delta for this version'}), 404
+    # The node falls back to the full image; later ones get the patch
+    delta_builder.submit(base_file, target_file)
+    resp = jsonify({'error': 'Delta is being built'})
+    resp.headers['Retry-After'] = '60'
+    return resp, 503
 
 @app.route('/firmware/version', methods=['GET'])
 def firmware_version():
-    firmware_dir = os.path.join(os.path.dirname(__file__), 'firmware')
-    version_file = os.path.join(firmware_dir, 'version.json')
-    if os.path.exists(version_file):
-        with open(version_file, 'r') as f:
-            version_data = json.load(f)
+    version_data = load_json_cached(os.path.join(FIRMWARE_DIR, 'version.json'))
+    if version_data is not None:
+        image = firmware_store.get(os.path.join(FIRMWARE_DIR, 'firmware.bin'))
+        if image:
+            version_data = dict(version_data, size=len(image.data), sha256=image.sha256)
         resp = make_response(jsonify(version_data))
         resp.headers['Content-Encoding'] = 'identity'
         resp.headers['Transfer-Encoding'] = 'identity'
@@ -109,4 +586,9 @@ def firmware_version():
         return jsonify({'error': 'Version file not found'}), 404
 
 if __name__ == '__main__':
+    # Development server; production runs under gunicorn, see gunicorn.conf.py
+    metrics.clear(METRICS_DIR)
+    start_services()
+    # Turn SIGTERM into a normal exit so the ingest queue is drained
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
     app.run(host='0.0.0.0', port=5000, ssl_context=('certs/cert.pem', 'certs/key.pem'))
\ No newline at end of file
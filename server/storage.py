@@ -0,0 +1,243 @@
+import contextlib
+import queue
+import sqlite3
+
+# Bumped whenever the table layout changes; stored in PRAGMA user_version
+SCHEMA_VERSION = 6
+
+CHANNELS = ('temperature', 'humidity', 'pressure', 'gas_resistance')
+COLUMNS = ('id', 'device', 'ts') + CHANNELS + ('fw',)
+
+# Rollup bucket widths in seconds, finest first
+TIERS = (60, 3600, 86400)
+ROLLUP_VALUES = tuple(f'{channel}_{agg}' for channel in CHANNELS for agg in ('min', 'max', 'sum'))
+
+INSERT_SQL = ('INSERT INTO sensor_data (device, ts, temperature, humidity, pressure, gas_resistance, fw) '
+              'VALUES (?, ?, ?, ?, ?, ?, ?)')
+
+# ts is Unix seconds (UTC) of acquisition; fw is the version the node reported
+SCHEMA = (
+    '''CREATE TABLE sensor_data (
+        id INTEGER PRIMARY KEY AUTOINCREMENT,
+        device TEXT NOT NULL DEFAULT '',
+        ts INTEGER NOT NULL,
+        temperature REAL,
+        humidity REAL,
+        pressure REAL,
+        gas_resistance REAL,
+        fw TEXT NOT NULL DEFAULT ''
+    )''',
+    'CREATE INDEX sensor_data_device_ts ON sensor_data (device, ts)',
+    'CREATE INDEX sensor_data_ts ON sensor_data (ts)',
+)
+
+# One row per (tier, device, bucket start). Sums rather than means so that
+# late samples merge exactly; dirty marks buckets not yet exported to InfluxDB.
+ROLLUP_SCHEMA = (
+    f'''CREATE TABLE rollup (
+        tier INTEGER NOT NULL,
+        device TEXT NOT NULL,
+        ts INTEGER NOT NULL,
+        n INTEGER NOT NULL,
+        {', '.join(f'{column} REAL' for column in ROLLUP_VALUES)},
+        dirty INTEGER NOT NULL DEFAULT 1,
+        PRIMARY KEY (tier, device, ts)
+    ) WITHOUT ROWID''',
+    'CREATE INDEX rollup_dirty ON rollup (dirty) WHERE dirty',
+)
+
+# Days of raw rows written to the columnar archive (archive.py), by UTC day start.
+# max_id is the highest sensor_data id in the file; later rows for the day are merged in.
+ARCHIVE_SCHEMA = (
+    '''CREATE TABLE archive (
+        day INTEGER PRIMARY KEY,
+        rows INTEGER NOT NULL,
+        bytes INTEGER NOT NULL,
+        max_id INTEGER NOT NULL DEFAULT 0
+    )''',
+)
+
+# Nodes currently allowed to download a firmware update (firmware.RolloutSlots)
+ROLLOUT_SCHEMA = (
+    '''CREATE TABLE rollout (
+        device TEXT PRIMARY KEY,
+        version TEXT NOT NULL,
+        granted INTEGER NOT NULL
+    )''',
+)
+
+
+def connect(db_file):
+    """Opens a connection set up for one writer and many concurrent readers.
+
+    WAL lets readers carry on while the ingest thread commits, and with WAL
+    synchronous=NORMAL only fsyncs at checkpoints, which is still safe
+    against an application crash.
+    """
+    conn = sqlite3.connect(db_file, timeout=10.0, check_same_thread=False)
+    conn.execute('PRAGMA journal_mode=WAL')
+    conn.execute('PRAGMA synchronous=NORMAL')
+    conn.execute('PRAGMA temp_store=MEMORY')
+    return conn
+
+
+def _columns(conn, table):
+    return [row[1] for row in conn.execute(f'PRAGMA table_info({table})')]
+
+
+def _create(conn, schema=SCHEMA):
+    for statement in schema:
+        conn.execute(statement)
+
+
+def _migrate_v0(conn):
+    """The original table kept local-time ISO strings and had no device column."""
+    conn.execute('ALTER TABLE sensor_data RENAME TO sensor_data_v0')
+    _create(conn)
+    conn.execute('''
+        INSERT INTO sensor_data (id, device, ts, temperature, humidity, pressure, gas_resistance)
+        SELECT id, '', CAST(COALESCE(strftime('%s', timestamp, 'utc'), 0) AS INTEGER),
+               temperature, humidity, pressure, gas_resistance
+        FROM sensor_data_v0
+    ''')
+    conn.execute('DROP TABLE sensor_data_v0')
+
+
+def _migrate_v1(conn):
+    """Adds the rollup tiers and fills them from the raw rows already stored."""
+    _create(conn, ROLLUP_SCHEMA)
+    aggregates = ', '.join(f'MIN({c}), MAX({c}), SUM({c})' for c in CHANNELS)
+    for tier in TIERS:
+        conn.execute(f'''
+            INSERT INTO rollup (tier, device, ts, n, {', '.join(ROLLUP_VALUES)})
+            SELECT {tier}, device, ts / {tier} * {tier}, COUNT(*), {aggregates}
+            FROM sensor_data GROUP BY device, ts / {tier}
+        ''')
+
+
+def init_db(db_file):
+    conn = connect(db_file)
+    try:
+        version = conn.execute('PRAGMA user_version').fetchone()[0]
+        if version == SCHEMA_VERSION:
+            return
+        # Explicit transaction: the sqlite3 module does not open one for DDL,
+        # and a half-migrated table must never be left behind
+        conn.isolation_level = None
+        conn.execute('BEGIN IMMEDIATE')
+        try:
+            # Another process may have migrated while this one waited for the lock
+            version = conn.execute('PRAGMA user_version').fetchone()[0]
+            if version == SCHEMA_VERSION:
+                conn.execute('COMMIT')
+                return
+            columns = _columns(conn, 'sensor_data')
+            if not columns:
+                _create(conn)
+                _create(conn, ROLLUP_SCHEMA)
+                _create(conn, ARCHIVE_SCHEMA)
+                _create(conn, ROLLOUT_SCHEMA)
+                message = f"Database {db_file} created and initialized."
+            else:
+                count = conn.execute('SELECT COUNT(*) FROM sensor_data').fetchone()[0]
+                if 'timestamp' in columns:
+                    _migrate_v0(conn)
+                if version < 2:
+                    _migrate_v1(conn)
+                if version < 3:
+                    _create(conn, ARCHIVE_SCHEMA)
+                if version < 4:
+                    _create(conn, ROLLOUT_SCHEMA)
+                if 'fw' not in _columns(conn, 'sensor_data'):
+                    conn.execute("ALTER TABLE sensor_data ADD COLUMN fw TEXT NOT NULL DEFAULT ''")
+                if 'max_id' not in _columns(conn, 'archive'):
+                    # 0 tells archive.py the day was archived without tracking ids
+                    conn.execute('ALTER TABLE archive ADD COLUMN max_id INTEGER NOT NULL DEFAULT 0')
+                message = f"Database {db_file} migrated to schema {SCHEMA_VERSION} ({count} rows)"
+            conn.execute(f'PRAGMA user_version={SCHEMA_VERSION}')
+            conn.execute('COMMIT')
+        except Exception:
+            conn.execute('ROLLBACK')
+            raise
+        print(message)
+    finally:
+        conn.close()
+
+
+class ConnectionPool:
+    """A fixed set of long-lived connections shared by request threads.
+
+    Sensor rows are only written by the ingest thread; handlers use these
+    for reads and small bookkeeping writes such as rollout slots.
+    """
+
+    def __init__(self, db_file, size=4):
+        self._idle = queue.LifoQueue()
+        for _ in range(size):
+            self._idle.put(connect(db_file))
+
+    @contextlib.contextmanager
+    def connection(self):
+        conn = self._idle.get()
+        try:
+            yield conn
+        finally:
+            self._idle.put(conn)
+
+    def close(self):
+        while not self._idle.empty():
+            self._idle.get_nowait().close()
+
+
+def row_dict(row):
+    return dict(zip(COLUMNS, row))
+
+
+def latest(conn, device=None):
+    select = f'SELECT {", ".join(COLUMNS)} FROM sensor_data'
+    if device is None:
+        row = conn.execute(f'{select} ORDER BY ts DESC, id DESC LIMIT 1').fetchone()
+    else:
+        row = conn.execute(f'{select} WHERE device = ? ORDER BY ts DESC, id DESC LIMIT 1',
+                           (device,)).fetchone()
+    return row_dict(row) if row else None
+
+
+def query_range(conn, start, end, device=None, limit=10000):
+    """Rows with start <= ts < end, oldest first; served from the (device, ts) or ts index."""
+    select = f'SELECT {", ".join(COLUMNS)} FROM sensor_data'
+    if device is None:
+        rows = conn.execute(f'{select} WHERE ts >= ? AND ts < ? ORDER BY ts LIMIT ?',
+                            (start, end, limit))
+    else:
+        rows = conn.execute(f'{select} WHERE device = ? AND ts >= ? AND ts < ? ORDER BY ts LIMIT ?',
+                            (device, start, end, limit))
+    return [row_dict(row) for row in rows]
+
+
+def recent(conn, n, device=None):
+    """The newest n rows, oldest first."""
+    select = f'SELECT {", ".join(COLUMNS)} FROM sensor_data'
+    if device is None:
+        rows = conn.execute(f'{select} ORDER BY ts DESC, id DESC LIMIT ?', (n,)).fetchall()
+    else:
+        rows = conn.execute(f'{select} WHERE device = ? ORDER BY ts DESC, id DESC LIMIT ?',
+                            (device, n)).fetchall()
+    return [row_dict(row) for row in reversed(rows)]
+
+
+def max_id(conn):
+    return conn.execute('SELECT COALESCE(MAX(id), 0) FROM sensor_data').fetchone()[0]
+
+
+def rows_after(conn, last_id, limit=1000):
+    """Rows inserted after last_id, in insertion order."""
+    rows = conn.execute(f'SELECT {", ".join(COLUMNS)} FROM sensor_data WHERE id > ? ORDER BY id LIMIT ?',
+                        (last_id, limit))
+    return [row_dict(row) for row in rows]
+
+
+def recent_per_device(conn, n):
+    """The newest n rows of every device, for warming in-memory caches at startup."""
+    devices = [row[0] for row in conn.execute('SELECT DISTINCT device FROM sensor_data')]
+    return [row for device in devices for row in recent(conn, n, device)]
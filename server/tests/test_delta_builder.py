@@ -0,0 +1,67 @@
+import os
+import random
+import struct
+import sys
+import tempfile
+import time
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+import delta_tool  # noqa: E402
+import firmware  # noqa: E402
+
+
+def image(seed, size=64 * 1024):
+    rng = random.Random(seed)
+    data = bytearray(rng.getrandbits(8) for _ in range(size))
+    struct.pack_into('<I', data, delta_tool.APP_DESC_OFFSET, delta_tool.APP_DESC_MAGIC)
+    return data
+
+
+class DeltaBuilderTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.base_file = os.path.join(self.dir.name, 'base.bin')
+        self.target_file = os.path.join(self.dir.name, 'firmware.bin')
+        self.base = image(1)
+        with open(self.base_file, 'wb') as f:
+            f.write(self.base)
+        self.builder = firmware.DeltaBuilder(os.path.join(self.dir.name, 'deltas'))
+        self.builder.start()
+
+    def tearDown(self):
+        self.builder.stop()
+        self.dir.cleanup()
+
+    def build(self, target):
+        with open(self.target_file, 'wb') as f:
+            f.write(target)
+        store = firmware.FirmwareStore()
+        base_sha, target_sha = store.get(self.base_file).sha256, store.get(self.target_file).sha256
+        path = self.builder.path(base_sha, target_sha)
+        self.builder.submit(self.base_file, self.target_file)
+        deadline = time.monotonic() + 10
+        while not (os.path.exists(path) or self.builder.unusable(base_sha, target_sha)):
+            self.assertLess(time.monotonic(), deadline, 'delta was not built')
+            time.sleep(0.01)
+        return path
+
+    def test_rebuilt_when_image_changes_under_same_name(self):
+        target = bytearray(self.base)
+        target[40000:40016] = b'new release code'
+        first = self.build(target)
+        target[50000:50016] = b'rebuilt, same ve'
+        second = self.build(target)
+        self.assertNotEqual(first, second)
+        with open(second, 'rb') as f:
+            self.assertEqual(delta_tool.apply_patch(self.base, f.read()), bytes(target))
+
+    def test_unrelated_image_marked_unusable(self):
+        path = self.build(image(2))
+        self.assertFalse(os.path.exists(path))
+        self.assertTrue(os.path.exists(path + '.none'))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,81 @@
+import os
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+from influx_writer import InfluxWriter  # noqa: E402
+
+
+class Line:
+    def __init__(self, i):
+        self.i = i
+
+    def to_line_protocol(self, precision=None):
+        return f'sensor temperature={self.i} {1700000000 + self.i}'
+
+
+class DownWriteApi:
+    def __init__(self):
+        self.calls = 0
+
+    def write(self, **kwargs):
+        self.calls += 1
+        raise ConnectionError('connection refused')
+
+    def close(self):
+        pass
+
+
+class DownClient:
+    def __init__(self):
+        self.api = DownWriteApi()
+
+    def write_api(self, write_options=None):
+        return self.api
+
+
+class CountingCondition(threading.Condition):
+    """Counts how often the lock is taken, which a spinning loop does constantly."""
+
+    def __init__(self):
+        super().__init__()
+        self.entered = 0
+
+    def __enter__(self):
+        self.entered += 1
+        return super().__enter__()
+
+
+class BackoffTest(unittest.TestCase):
+    def test_full_buffer_does_not_spin_while_backing_off(self):
+        client = DownClient()
+        with tempfile.TemporaryDirectory() as spool:
+            writer = InfluxWriter(client, 'sensor', spool, batch_size=10, flush_interval=0.05,
+                                  retry_initial=4.0)
+            writer._cond = CountingCondition()
+            writer.write([Line(i) for i in range(30)])
+            writer.start()
+            try:
+                deadline = time.monotonic() + 2
+                while client.api.calls == 0 and time.monotonic() < deadline:
+                    time.sleep(0.01)
+                self.assertEqual(client.api.calls, 1)
+
+                # Still a full batch buffered and more arriving; the thread must sleep
+                writer.write([Line(i) for i in range(30, 40)])
+                entered = writer._cond.entered
+                time.sleep(0.5)
+                self.assertEqual(client.api.calls, 1)
+                self.assertLess(writer._cond.entered - entered, 5)
+            finally:
+                writer.close()
+            # What could not be sent is spooled, not lost
+            self.assertEqual(writer.stats()['spilled'], 40)
+
+
+if __name__ == '__main__':
+    unittest.main()
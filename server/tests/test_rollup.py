@@ -0,0 +1,63 @@
+import os
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+import rollup  # noqa: E402
+import storage  # noqa: E402
+
+NOW = 1699999980  # minute-aligned, so the hour is exactly 60 buckets
+START = NOW - 3600
+
+
+class TierChoiceTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        db_file = os.path.join(self.dir.name, 'sensor.db')
+        storage.init_db(db_file)
+        self.conn = storage.connect(db_file)
+        # Two nodes uploading every 5 s, as in continuous mode: 720 rows each in the hour
+        rows = [(device, START + i * 5, 20.0, 40.0, 101300.0, 100000.0, '')
+                for device in ('a', 'b') for i in range(720)]
+        with self.conn:
+            self.conn.executemany(storage.INSERT_SQL, rows)
+            rollup.apply(self.conn, rows)
+
+    def tearDown(self):
+        self.conn.close()
+        self.dir.cleanup()
+
+    def test_raw_when_rows_fit(self):
+        tier, rows = rollup.query(self.conn, START, NOW, 'a', max_points=720, now=NOW)
+        self.assertEqual(tier, 'raw')
+        self.assertEqual(len(rows), 720)
+
+    def test_dense_device_drops_to_minutes(self):
+        # An hour is only 60 one-minute rows, but this node stored 720 raw ones
+        tier, rows = rollup.query(self.conn, START, NOW, 'a', max_points=100, now=NOW)
+        self.assertEqual(tier, '1m')
+        self.assertEqual(len(rows), 60)
+
+    def test_fleet_counts_densest_device(self):
+        tier, rows = rollup.query(self.conn, START, NOW, max_points=720, now=NOW)
+        self.assertEqual(tier, 'raw')
+        self.assertEqual(len(rows), 1440)
+        tier, _ = rollup.query(self.conn, START, NOW, max_points=719, now=NOW)
+        self.assertEqual(tier, '1m')
+
+    def test_never_truncates_raw(self):
+        # Past the row cap the whole range comes from a rollup instead of its oldest rows
+        old_limit = rollup.RAW_ROW_LIMIT
+        rollup.RAW_ROW_LIMIT = 1000
+        try:
+            tier, rows = rollup.query(self.conn, START, NOW, max_points=1000, now=NOW)
+        finally:
+            rollup.RAW_ROW_LIMIT = old_limit
+        self.assertEqual(tier, '1m')
+        self.assertEqual(rows[-1]['ts'], NOW - 60)
+
+
+if __name__ == '__main__':
+    unittest.main()